@@ -0,0 +1,356 @@
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "chordparser.h"
+#include "ensembleparser.h"
+#include "rhythmparser.h"
+#include "voicingcache.h"
+#include "voiceleading.h"
+#include "costkernel.h"
+#include "threadpool.h"
+#include "progression.h"
+#include "arrangement.h"
+#include "midisink.h"
+
+
+/*
+ * Microbenchmarks of the hot paths of voicing and playing a progression.  All progressions
+ * are generated from a fixed seed, so the numbers of different builds can be compared.  Run
+ * with --benchmark_format=json or --benchmark_out=FILE to track them.
+ */
+
+static const char* const ensemble_names[]={ "strings", "stringensemble", "reeds" };
+
+static const char* const chord_kinds[]={ "", "m", "7", "m7", "maj7", "6", "m6", "9", "dim", "aug", "sus2", "sus4", "7+11" };
+static const char* const chord_roots[]={ "C", "C#", "Db", "D", "Eb", "E", "F", "F#", "Gb", "G", "Ab", "A", "Bb", "B" };
+
+static const int progression_seed=20240611;
+
+
+static std::string get_definition_filename(const char* category, const char* name)
+{
+    return std::string(CHORDPLAY_SOURCE_DIR) + '/' + category + '/' + name;
+}
+
+
+static const Ensemble& get_ensemble(int i)
+{
+    static Ensemble ensembles[std::size(ensemble_names)];
+    static bool loaded[std::size(ensemble_names)];
+
+    if (!loaded[i]) {
+        std::ifstream file(get_definition_filename("ensembles", ensemble_names[i]));
+        std::vector<ParseDiagnostic> diagnostics;
+
+        ensembles[i]=EnsembleParser()(file, diagnostics);
+        for (const auto& diag: diagnostics)
+            std::cerr << "Error parsing ensemble definition " << ensemble_names[i] << ", " << diag << std::endl;
+
+        loaded[i]=true;
+    }
+
+    return ensembles[i];
+}
+
+
+static const Rhythm& get_rhythm()
+{
+    static Rhythm rhythm=[] {
+        std::ifstream file(get_definition_filename("rhythms", "ballad"));
+        std::vector<ParseDiagnostic> diagnostics;
+
+        Rhythm rhythm=RhythmParser()(file, diagnostics);
+        for (const auto& diag: diagnostics)
+            std::cerr << "Error parsing rhythm definition ballad, " << diag << std::endl;
+
+        return rhythm;
+    }();
+
+    return rhythm;
+}
+
+
+static std::vector<std::string> generate_chord_names(int count)
+{
+    std::mt19937 random(progression_seed);
+
+    std::vector<std::string> names;
+    for (int i=0;i<count;i++)
+        names.push_back(std::string(chord_roots[random()%std::size(chord_roots)]) + chord_kinds[random()%std::size(chord_kinds)]);
+
+    return names;
+}
+
+
+static std::vector<Chord> generate_progression(int count)
+{
+    ChordParser parsechord;
+
+    std::vector<Chord> chords;
+    for (const std::string& name: generate_chord_names(count))
+        chords.push_back(*parsechord(name.c_str()));
+
+    return chords;
+}
+
+
+// bars are not copyable because of their voicings
+static std::vector<Bar> make_bars(const std::vector<Chord>& chords)
+{
+    std::vector<Bar> bars(chords.size());
+    for (size_t i=0;i<chords.size();i++)
+        bars[i].chord=chords[i];
+
+    return bars;
+}
+
+
+// a progression with its voicings already computed, for the benchmarks of what follows
+static std::vector<Bar> generate_voiced_progression(const Ensemble& ensemble, int count)
+{
+    VoicingCache voicingcache(ensemble);
+    ThreadPool threadpool(1);
+
+    std::vector<Bar> bars=make_bars(generate_progression(count));
+    voice_progression(voicingcache, threadpool, bars, ProgressionOptions());
+
+    return bars;
+}
+
+
+static void set_bars_processed(benchmark::State& state, int count)
+{
+    state.SetItemsProcessed(state.iterations()*count);
+    state.counters["bars"]=count;
+}
+
+
+static void BM_ParseChord(benchmark::State& state)
+{
+    const std::vector<std::string> names=generate_chord_names(4096);
+    ChordParser parsechord;
+
+    size_t i=0;
+    for (auto _: state) {
+        benchmark::DoNotOptimize(parsechord(names[i].c_str()));
+        i=(i+1)%names.size();
+    }
+
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_ParseChord);
+
+
+// per ensemble and chord kind, always with C as the root
+static void BM_EnumerateHarmonyVoicings(benchmark::State& state)
+{
+    const Ensemble& ensemble=get_ensemble(state.range(0));
+    const std::string name=std::string("C") + chord_kinds[state.range(1)];
+    const Chord chord=*ChordParser()(name.c_str());
+
+    int count=0;
+    for (auto _: state) {
+        Ensemble::VoicingTable voicings=ensemble.enumerate_harmony_voicings(chord);
+        count=voicings.size();
+        benchmark::DoNotOptimize(voicings);
+    }
+
+    state.SetLabel(std::string(ensemble_names[state.range(0)]) + '/' + name);
+    state.counters["voicings"]=count;
+}
+
+BENCHMARK(BM_EnumerateHarmonyVoicings)->ArgsProduct({
+    benchmark::CreateDenseRange(0, std::size(ensemble_names)-1, 1),
+    benchmark::CreateDenseRange(0, std::size(chord_kinds)-1, 1)
+});
+
+
+// between all voicings of two chords which are typical neighbours
+static void BM_VoiceLeadingCost(benchmark::State& state)
+{
+    const Ensemble& ensemble=get_ensemble(state.range(0));
+    const Ensemble::VoicingTable from=ensemble.enumerate_harmony_voicings(*ChordParser()("Dm7"));
+    const Ensemble::VoicingTable to=ensemble.enumerate_harmony_voicings(*ChordParser()("G7"));
+
+    for (auto _: state) {
+        for (int i=0;i<from.size();i++)
+            for (int j=0;j<to.size();j++)
+                benchmark::DoNotOptimize(compute_voice_leading_cost(from[i], to[j]));
+    }
+
+    state.SetLabel(ensemble_names[state.range(0)]);
+    state.SetItemsProcessed(state.iterations()*from.size()*to.size());
+}
+
+BENCHMARK(BM_VoiceLeadingCost)->DenseRange(0, std::size(ensemble_names)-1, 1);
+
+
+// The same through the cost kernel, which all the solvers use, registered in main once for
+// every kernel the CPU supports.
+static void BM_VoiceLeadingCostKernel(benchmark::State& state, const std::string& kernel)
+{
+    const std::string previous=get_cost_kernel_name();
+    select_cost_kernel(kernel);
+
+    const Ensemble& ensemble=get_ensemble(state.range(0));
+    const Ensemble::VoicingTable from=ensemble.enumerate_harmony_voicings(*ChordParser()("Dm7"));
+    const Ensemble::VoicingTable to=ensemble.enumerate_harmony_voicings(*ChordParser()("G7"));
+
+    std::vector<int> costs(to.size());
+
+    for (auto _: state) {
+        for (int i=0;i<from.size();i++) {
+            compute_voice_leading_costs(from[i], to, 0, to.size(), costs.data());
+            benchmark::DoNotOptimize(costs.data());
+        }
+    }
+
+    select_cost_kernel(previous);
+
+    state.SetLabel(ensemble_names[state.range(0)]);
+    state.SetItemsProcessed(state.iterations()*from.size()*to.size());
+}
+
+
+// the whole dynamic program, with all voicings already in the cache
+static void BM_VoiceLeading(benchmark::State& state)
+{
+    const Ensemble& ensemble=get_ensemble(0);
+    VoicingCache voicingcache(ensemble);
+    ThreadPool threadpool(1);
+
+    const std::vector<Chord> progression=generate_progression(state.range(0));
+    for (const Chord& chord: progression)
+        voicingcache(chord);
+
+    for (auto _: state) {
+        state.PauseTiming();
+        std::vector<Bar> bars=make_bars(progression);
+        state.ResumeTiming();
+
+        benchmark::DoNotOptimize(compute_voice_leading(voicingcache, threadpool, bars, false));
+    }
+
+    set_bars_processed(state, progression.size());
+}
+
+BENCHMARK(BM_VoiceLeading)->Arg(4)->Arg(16)->Arg(64)->Arg(256)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+
+static void BM_ScalesForChords(benchmark::State& state)
+{
+    const std::vector<Chord> progression=generate_progression(state.range(0));
+
+    for (auto _: state) {
+        state.PauseTiming();
+        std::vector<Bar> bars=make_bars(progression);
+        state.ResumeTiming();
+
+        compute_scales_for_chords(bars);
+        benchmark::ClobberMemory();
+    }
+
+    set_bars_processed(state, progression.size());
+}
+
+BENCHMARK(BM_ScalesForChords)->Arg(4)->Arg(16)->Arg(64)->Arg(256)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+
+static void BM_ImproviseMelody(benchmark::State& state)
+{
+    const Ensemble& ensemble=get_ensemble(0);
+    const std::vector<Bar> bars=generate_voiced_progression(ensemble, state.range(0));
+
+    for (auto _: state)
+        benchmark::DoNotOptimize(improvise_melody(bars, ensemble.get_melody_voice(0), progression_seed));
+
+    set_bars_processed(state, bars.size());
+}
+
+BENCHMARK(BM_ImproviseMelody)->Arg(4)->Arg(16)->Arg(64)->Arg(256)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+
+// Appends the events of all voices to the tracks, like before playback.  The sequencer starts
+// an output thread, so it is created outside of the timing.
+static void BM_RenderProgression(benchmark::State& state)
+{
+    const Ensemble& ensemble=get_ensemble(0);
+    const Rhythm& rhythm=get_rhythm();
+    const std::vector<Bar> bars=generate_voiced_progression(ensemble, state.range(0));
+
+    ProgressionOptions options;
+    options.improvise=true;
+    options.seed=progression_seed;
+
+    NullMidiSink sink;
+    MidiOut midiout(sink);
+
+    for (auto _: state) {
+        state.PauseTiming();
+        auto seq=std::make_unique<Sequencer>(midiout, 120, 0, compute_ticks_per_beat(rhythm));
+        state.ResumeTiming();
+
+        render_progression(*seq, ensemble, rhythm, bars, options);
+
+        state.PauseTiming();
+        seq.reset();
+        state.ResumeTiming();
+    }
+
+    set_bars_processed(state, bars.size());
+}
+
+BENCHMARK(BM_RenderProgression)->Arg(4)->Arg(16)->Arg(64)->Arg(256)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+
+// merges the tracks into a single sequence of messages, which is what playback does as well
+static void BM_WriteSmf(benchmark::State& state)
+{
+    const Ensemble& ensemble=get_ensemble(0);
+    const Rhythm& rhythm=get_rhythm();
+    const std::vector<Bar> bars=generate_voiced_progression(ensemble, state.range(0));
+
+    ProgressionOptions options;
+    options.improvise=true;
+    options.seed=progression_seed;
+
+    NullMidiSink sink;
+    MidiOut midiout(sink);
+    Sequencer seq(midiout, 120, 0, compute_ticks_per_beat(rhythm));
+    render_progression(seq, ensemble, rhythm, bars, options);
+
+    for (auto _: state)
+        benchmark::DoNotOptimize(seq.write_smf("/dev/null"));
+
+    set_bars_processed(state, bars.size());
+}
+
+BENCHMARK(BM_WriteSmf)->Arg(4)->Arg(16)->Arg(64)->Arg(256)->Arg(1000)->Unit(benchmark::kMicrosecond);
+
+
+int main(int argc, char** argv)
+{
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+
+    const std::string initial=get_cost_kernel_name();
+
+    for (const char* kernel: { "avx2", "sse4.1", "scalar" }) {
+        if (!select_cost_kernel(kernel)) continue;
+
+        benchmark::RegisterBenchmark((std::string("BM_VoiceLeadingCostKernel/") + kernel).c_str(), BM_VoiceLeadingCostKernel, std::string(kernel))
+            ->DenseRange(0, std::size(ensemble_names)-1, 1);
+    }
+
+    select_cost_kernel(initial);
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
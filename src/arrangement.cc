@@ -0,0 +1,263 @@
+#include <numeric>
+#include <random>
+#include <stdlib.h>
+#include <math.h>
+#include "arrangement.h"
+#include "stats.h"
+
+
+std::vector<Note> improvise_melody(const std::vector<Bar>& bars, const Ensemble::Voice& melvoice, uint32_t seed)
+{
+    std::vector<Note> melody;
+    std::vector<std::vector<Note>> noteset;
+
+    const int n=bars.size()*2 - 1;
+
+    for (int i=0;i<n;i++) {
+        const Chord& chord=bars[i/2].chord;
+
+        Note initial_note;
+
+        std::vector<Note> notes;
+        for (int j=0;j<6 && chord.notes[j];j++) {
+            for (int k=0;k<10;k++) {
+                Note note(chord.notes[j], k);
+                if (note<melvoice.range_low) continue;
+                if (note>melvoice.range_high) break;
+
+                if (!j && !initial_note)
+                    initial_note=note;
+
+                notes.push_back(note);
+            }
+        }
+
+        noteset.push_back(std::move(notes));
+        melody.push_back(initial_note);
+    }
+
+    struct NoteCandidate {
+        Note    note;
+        float   cumul;
+    };
+
+    std::mt19937 random(seed);
+
+    for (int pass=0;pass<10;pass++) {
+        for (int i=1;i+1<n;i++) {
+            std::vector<NoteCandidate> candidates;
+            float cumul=0.0f;
+
+            for (const Note& note: noteset[i]) {
+                auto Pr=[](int d) { return expf(-0.75f*abs(d))*abs(d); };
+
+                float prob=Pr(note.get_midi_note() - melody[i-1].get_midi_note()) * Pr(note.get_midi_note() - melody[i+1].get_midi_note());
+                //printf("%s %s %s: %f (%f)\n", melody[i-1].get_name().c_str(), note.get_name().c_str(), melody[i+1].get_name().c_str(), prob, cumul);
+
+                NoteCandidate nc;
+                nc.note=note;
+                nc.cumul=cumul;
+                cumul+=prob;
+
+                candidates.push_back(nc);
+            }
+
+            float v=cumul * ldexpf(random()&0xfffff, -20);
+            int c=0;
+            while (c+1<candidates.size() && candidates[c+1].cumul<=v) c++;
+
+            //printf("total=%f  v=%f  c=%d\n", cumul, v, c);
+
+            melody[i]=candidates[c].note;
+        }
+    }
+
+    return melody;
+}
+
+
+std::vector<Note> improvise_passing_notes(const std::vector<Note>& in_melody, const std::vector<Bar>& bars)
+{
+    std::vector<Note> melody;
+
+    for (int i=0;i+1<in_melody.size();i++) {
+        const Scale& scale=bars[i/2].scale;
+
+        melody.push_back(in_melody[i]);
+
+        int8_t prev=scale.to_scale(in_melody[i]);
+        int8_t next=scale.to_scale(in_melody[i+1]);
+
+        switch (next-prev) {
+        case -3:
+        case -2:
+            melody.push_back(scale(prev-1));
+            break;
+        case -4:
+        case -1:
+            melody.push_back(scale(prev-2));
+            break;
+        case 1:
+        case 4:
+            melody.push_back(scale(prev+2));
+            break;
+        case 0:
+        case 2:
+        case 3:
+            melody.push_back(scale(prev+1));
+            break;
+        default:
+            melody.push_back(in_melody[i]);
+        }
+    }
+
+    melody.push_back(in_melody.back());
+
+    return melody;
+}
+
+
+// The default resolution, refined such that all steps of the rhythm patterns fall on whole
+// ticks.  A pattern of m steps spans four beats, so m/gcd(m, 4) has to divide the result.
+int compute_ticks_per_beat(const Rhythm& rhythm)
+{
+    int ppq=Sequencer::default_ticks_per_beat;
+
+    for (int i=0;i<rhythm.get_voice_count();i++) {
+        const auto& voice=rhythm.get_voice(i);
+
+        for (const std::string* pattern: { &voice.pattern, &voice.loop_end_pattern }) {
+            const int m=pattern->length();
+            if (m>0)
+                ppq=std::lcm(ppq, m/std::gcd(m, 4));
+        }
+    }
+
+    return ppq;
+}
+
+
+BarTracks add_bar_tracks(Sequencer& seq, const Ensemble& ensemble, const Rhythm& rhythm, const ProgressionOptions& options)
+{
+    BarTracks tracks;
+    tracks.ticks_per_beat=seq.get_ticks_per_beat();
+
+    for (int i=0;i<ensemble.get_harmony_voice_count();i++) {
+        const auto& voice=ensemble.get_harmony_voice(i);
+        auto* track=seq.add_track(voice.midi_channel, voice.midi_program);
+        track->set_tie_notes(options.tie);
+        tracks.harmony.push_back(track);
+    }
+
+    for (int i=0;i<rhythm.get_voice_count();i++) {
+        const auto& voice=rhythm.get_voice(i);
+        tracks.rhythm.push_back(seq.add_track(voice.midi_channel, voice.midi_program));
+    }
+
+    tracks.all=tracks.harmony;
+    tracks.all.insert(tracks.all.end(), tracks.rhythm.begin(), tracks.rhythm.end());
+
+    return tracks;
+}
+
+
+void render_bar(const BarTracks& tracks, const Ensemble& ensemble, const Rhythm& rhythm, const Bar& bar, const Bar* next, uint32_t tick, bool loopend, const ProgressionOptions& options)
+{
+    const int ppq=tracks.ticks_per_beat;
+
+    for (int i=0;i<ensemble.get_harmony_voice_count();i++) {
+        const auto& voice=ensemble.get_harmony_voice(i);
+
+        auto* track=tracks.harmony[i];
+
+        track->append_note(tick, bar.voicing[i], voice.midi_velocity);
+
+        if (options.embellish && voice.role==Ensemble::Voice::Role::Harmony && next) {
+            const int cur =bar.scale.to_scale(bar.voicing[i]);
+            const int succ=bar.scale.to_scale(next->voicing[i]);
+
+            if (cur+1<succ)
+                track->append_note(tick + 3*ppq, bar.scale(succ-1), voice.midi_velocity);
+            if (cur-1>succ)
+                track->append_note(tick + 3*ppq, bar.scale(succ+1), voice.midi_velocity);
+        }
+    }
+
+    for (int i=0;i<tracks.rhythm.size();i++) {
+        const auto& voice=rhythm.get_voice(i);
+
+        auto* track=tracks.rhythm[i];
+
+        const auto& pattern=(!loopend || voice.loop_end_pattern.empty()) ? voice.pattern : voice.loop_end_pattern;
+
+        const int m=pattern.length();
+
+        // exact, see compute_ticks_per_beat
+        auto step=[tick, ppq, m](int k) { return tick + 4*ppq*k/m; };
+
+        if (voice.role==Rhythm::Voice::Role::Percussion) {
+            for (int k=0;k<m;k++) {
+                switch (pattern[k]) {
+                case 'X':
+                    track->append_note(step(k), voice.midi_note, voice.midi_velocity_strong);
+                    break;
+                case 'x':
+                    track->append_note(step(k), voice.midi_note, voice.midi_velocity_weak);
+                    break;
+                case '.':
+                    track->append_pause(step(k));
+                    break;
+                }
+            }
+        }
+        else {  // bass
+            const Note bassnote=bar.voicing[0];
+
+            for (int k=0;k<m;k++) {
+                switch (pattern[k]) {
+                case 'X':
+                    track->append_note(step(k), bassnote, voice.midi_velocity_strong);
+                    break;
+                case 'x':
+                    track->append_note(step(k), bassnote, voice.midi_velocity_weak);
+                    break;
+                case '.':
+                    track->append_pause(step(k));
+                    break;
+                }
+            }
+        }
+    }
+}
+
+
+void render_progression(Sequencer& seq, const Ensemble& ensemble, const Rhythm& rhythm, const std::vector<Bar>& bars, const ProgressionOptions& options)
+{
+    Stats::ScopedTimer timer(Stats::Timer::Render);
+
+    const int ppq=seq.get_ticks_per_beat();
+
+    const BarTracks tracks=add_bar_tracks(seq, ensemble, rhythm, options);
+
+    for (int j=0;j<bars.size();j++) {
+        const Bar* next=j+1<bars.size() ? &bars[j+1] : options.loop ? &bars[0] : nullptr;
+        render_bar(tracks, ensemble, rhythm, bars[j], next, 4*ppq*j, options.loop && j+1==bars.size(), options);
+    }
+
+    for (auto* track: tracks.all)
+        track->append_pause(4*ppq*bars.size());
+
+    if (options.improvise && ensemble.get_melody_voice_count()>0) {
+        std::vector<Note> melody=improvise_melody(bars, ensemble.get_melody_voice(0), options.seed);
+        melody=improvise_passing_notes(melody, bars);
+
+        const auto& melody_voice=ensemble.get_melody_voice(0);
+        auto* melody_track=seq.add_track(melody_voice.midi_channel, melody_voice.midi_program);
+
+        const int melody_timing[4]={ 0, 3*ppq/2, 2*ppq, 7*ppq/2 };
+        for (int i=0;i<melody.size();i++)
+            melody_track->append_note((i&~3)*ppq + melody_timing[i&3], melody[i], melody_voice.midi_velocity);
+        
+        melody_track->append_pause(melody.size()*ppq);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef INCLUDE_ARRANGEMENT_H
+#define INCLUDE_ARRANGEMENT_H
+
+#include <vector>
+#include "progression.h"
+#include "rhythm.h"
+#include "midi.h"
+
+
+std::vector<Note> improvise_melody(const std::vector<Bar>&, const Ensemble::Voice& melvoice, uint32_t seed);
+std::vector<Note> improvise_passing_notes(const std::vector<Note>& melody, const std::vector<Bar>&);
+
+// the resolution needed to place all steps of the rhythm patterns exactly
+int compute_ticks_per_beat(const Rhythm&);
+
+
+// sequencer tracks of the harmony and rhythm voices
+struct BarTracks {
+    int                             ticks_per_beat;
+    std::vector<Sequencer::Track*>  harmony;
+    std::vector<Sequencer::Track*>  rhythm;
+    std::vector<Sequencer::Track*>  all;
+};
+
+BarTracks add_bar_tracks(Sequencer&, const Ensemble&, const Rhythm&, const ProgressionOptions&);
+
+// Appends the harmony and rhythm of one bar starting at the given tick.  next is the following
+// bar if any, and loopend tells whether the bar is the last one of a loop.
+void render_bar(const BarTracks&, const Ensemble&, const Rhythm&, const Bar& bar, const Bar* next, uint32_t tick, bool loopend, const ProgressionOptions&);
+
+// Adds tracks for all voices to the sequencer and renders the whole progression into them,
+// with an improvised melody if asked for.
+void render_progression(Sequencer&, const Ensemble&, const Rhythm&, const std::vector<Bar>&, const ProgressionOptions&);
+
+#endif
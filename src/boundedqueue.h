@@ -0,0 +1,63 @@
+#ifndef INCLUDE_BOUNDEDQUEUE_H
+#define INCLUDE_BOUNDEDQUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+
+// Blocking queue of limited capacity for handing items from one thread to another.
+// After close(), push fails and pop fails as soon as the remaining items are taken.
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity):capacity(capacity) {}
+
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notfull.wait(lock, [this]() { return closed || items.size()<capacity; });
+
+        if (closed) return false;
+
+        items.push_back(std::move(item));
+        notempty.notify_one();
+
+        return true;
+    }
+
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notempty.wait(lock, [this]() { return closed || !items.empty(); });
+
+        if (items.empty()) return false;
+
+        item=std::move(items.front());
+        items.pop_front();
+        notfull.notify_one();
+
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        closed=true;
+        notfull.notify_all();
+        notempty.notify_all();
+    }
+
+private:
+    const size_t            capacity;
+
+    std::mutex              mutex;
+    std::condition_variable notfull;
+    std::condition_variable notempty;
+
+    std::deque<T>           items;
+    bool                    closed=false;
+};
+
+#endif
@@ -1,105 +1,132 @@
-#include <sstream>
-#include <regex>
+#include <limits.h>
+#include <string.h>
 #include "chordparser.h"
 
 
-struct ChordParser::Internal {
-    std::regex  regex { "([A-G][#b]?)(?:(m|dim|aug)?(6|7|9)?|(maj7|sus2|sus4))((?:\\+[0-9]+)*)(?:/([A-G][#b]?))?" };
-};
+/*
+ * The grammar of chord names is
+ *
+ *   root ( quality? (6|7|9)? | maj7 | sus2 | sus4 ) tension* ( / bass )?
+ *
+ * with root and bass a note name like C, F# or Bb, quality one of m, dim or aug, and each
+ * tension a plus sign followed by a scale step.  It is parsed in a single pass without any
+ * allocations, as chord charts may contain many thousands of chords.
+ */
 
-
-ChordParser::ChordParser()
+static bool skip_prefix(const char*& p, const char* prefix)
 {
-    internal=new Internal;
-}
-
+    const size_t len=strlen(prefix);
+    if (strncmp(p, prefix, len))
+        return false;
 
-ChordParser::~ChordParser()
-{
-    delete internal;
+    p+=len;
+    return true;
 }
 
 
 std::optional<Chord> ChordParser::operator()(const char* name) const
 {
-    std::cmatch result;
-    if (!std::regex_match(name, result, internal->regex))
-        return std::nullopt;
+    const char* p=name;
+    const char* end=name+strlen(name);
 
     Chord chord;
     chord.required=7;
 
-    chord.notes[0]=NoteClass(result[1].str());
-    chord.bass=NoteClass(result[6].str());
+    if (!parse_note_class(p, end, chord.notes[0]))
+        return std::nullopt;
 
-    if (result[4]=="maj7") {
+    if (skip_prefix(p, "maj7")) {
         chord.quality=Chord::Quality::Major;
         chord.required=11;
         chord.notes[1]=chord.notes[0] + Interval(2, 4);
         chord.notes[2]=chord.notes[0] + Interval(4, 7);
         chord.notes[3]=chord.notes[0] + Interval(6, 11);
     }
-    else if (result[4]=="sus2") {
+    else if (skip_prefix(p, "sus2")) {
         chord.quality=Chord::Quality::Sus2;
         chord.notes[1]=chord.notes[0] + Interval(1, 2);
         chord.notes[2]=chord.notes[0] + Interval(4, 7);
     }
-    else if (result[4]=="sus4") {
+    else if (skip_prefix(p, "sus4")) {
         chord.quality=Chord::Quality::Sus4;
         chord.notes[1]=chord.notes[0] + Interval(3, 5);
         chord.notes[2]=chord.notes[0] + Interval(4, 7);
     }
-    else if (result[2]=="m") {
-        chord.quality=Chord::Quality::Minor;
-        chord.notes[1]=chord.notes[0] + Interval(2, 3);
-        chord.notes[2]=chord.notes[0] + Interval(4, 7);
-    }
-    else if (result[2]=="dim") {
-        chord.quality=Chord::Quality::Diminished;
-        chord.notes[1]=chord.notes[0] + Interval(2, 3);
-        chord.notes[2]=chord.notes[0] + Interval(4, 6);
-    }
-    else if (result[2]=="aug") {
-        chord.quality=Chord::Quality::Augmented;
-        chord.notes[1]=chord.notes[0] + Interval(2, 4);
-        chord.notes[2]=chord.notes[0] + Interval(4, 8);
-    }
     else {
-        chord.quality=Chord::Quality::Major;
-        chord.notes[1]=chord.notes[0] + Interval(2, 4);
-        chord.notes[2]=chord.notes[0] + Interval(4, 7);
-    }
+        if (skip_prefix(p, "m")) {
+            chord.quality=Chord::Quality::Minor;
+            chord.notes[1]=chord.notes[0] + Interval(2, 3);
+            chord.notes[2]=chord.notes[0] + Interval(4, 7);
+        }
+        else if (skip_prefix(p, "dim")) {
+            chord.quality=Chord::Quality::Diminished;
+            chord.notes[1]=chord.notes[0] + Interval(2, 3);
+            chord.notes[2]=chord.notes[0] + Interval(4, 6);
+        }
+        else if (skip_prefix(p, "aug")) {
+            chord.quality=Chord::Quality::Augmented;
+            chord.notes[1]=chord.notes[0] + Interval(2, 4);
+            chord.notes[2]=chord.notes[0] + Interval(4, 8);
+        }
+        else {
+            chord.quality=Chord::Quality::Major;
+            chord.notes[1]=chord.notes[0] + Interval(2, 4);
+            chord.notes[2]=chord.notes[0] + Interval(4, 7);
+        }
 
-    if (result[3]=="6") {
-        chord.required=15;
-        chord.notes[3]=chord.notes[0] + Interval(5, 9);
-    }
-    else if (result[3]=="7") {
-        chord.required=11;
-        chord.notes[3]=chord.notes[0] + Interval(6, 10);
-    }
-    else if (result[3]=="9") {
-        chord.required=19;
-        chord.notes[3]=chord.notes[0] + Interval(6, 10);
-        chord.notes[4]=chord.notes[0] + Interval(1, 2);
+        if (*p=='6') {
+            chord.required=15;
+            chord.notes[3]=chord.notes[0] + Interval(5, 9);
+            p++;
+        }
+        else if (*p=='7') {
+            chord.required=11;
+            chord.notes[3]=chord.notes[0] + Interval(6, 10);
+            p++;
+        }
+        else if (*p=='9') {
+            chord.required=19;
+            chord.notes[3]=chord.notes[0] + Interval(6, 10);
+            chord.notes[4]=chord.notes[0] + Interval(1, 2);
+            p++;
+        }
     }
 
     // parse tensions
-    std::stringstream tensions(result[5].str());
-    std::string token;
-    while (getline(tensions, token, '+'))
-        if (token.size()) {
-            int step=stoi(token) - 1;
-            if (step<0)
-                return std::nullopt;
-            
-            int octaves=step/7;
-            step%=7;
+    while (*p=='+') {
+        p++;
 
-            const static int8_t semitones[]={ 0, 2, 4, 5, 7, 9, 11 };
-            if (!chord.append(chord.notes[0] + Interval(step, semitones[step] + octaves*12)))
+        if (*p<'0' || *p>'9')
+            return std::nullopt;
+
+        int step=0;
+        while (*p>='0' && *p<='9') {
+            if (step>(INT_MAX-9)/10)
                 return std::nullopt;
+
+            step=step*10 + (*p++ - '0');
         }
 
+        if (--step<0)
+            return std::nullopt;
+
+        int octaves=step/7;
+        step%=7;
+
+        const static int8_t semitones[]={ 0, 2, 4, 5, 7, 9, 11 };
+        if (!chord.append(chord.notes[0] + Interval(step, semitones[step] + octaves*12)))
+            return std::nullopt;
+    }
+
+    if (*p=='/') {
+        p++;
+
+        if (!parse_note_class(p, end, chord.bass))
+            return std::nullopt;
+    }
+
+    if (*p)
+        return std::nullopt;
+
     return chord;
 }
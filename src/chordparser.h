@@ -6,14 +6,7 @@
 
 
 class ChordParser {
-    struct Internal;
-
-    Internal*   internal;
-
 public:
-    ChordParser();
-    ~ChordParser();
-    
     std::optional<Chord> operator()(const char*) const;
 };
  
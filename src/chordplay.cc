@@ -1,31 +1,87 @@
 #include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <thread>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
 #include <math.h>
 #include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <popt.h>
+#include <RtMidi.h>
 #include "config.h"
 #include "chordparser.h"
 #include "ensembleparser.h"
 #include "rhythmparser.h"
 #include "scale.h"
+#include "voicingcache.h"
+#include "voiceleading.h"
+#include "threadpool.h"
+#include "boundedqueue.h"
 #include "midi.h"
+#include "progression.h"
+#include "arrangement.h"
+#include "stats.h"
 
 int opt_play=0;
 int opt_loop=0;
 int opt_embellish=0;
+int opt_tie=0;
 int opt_improvise=0;
 int opt_bpm=120;
 int opt_midi_port=-1;
+int opt_spin=0;
+int opt_realtime=0;
+int opt_voicing_cache=0;
+int opt_threads=0;
+int opt_beam_width=0;
+int opt_best=1;
+int opt_compare_exact=0;
+int opt_stream=0;
+int opt_lookahead=4;
+const char* opt_batch=nullptr;
+const char* opt_batch_format="json";
+const char* opt_serve=nullptr;
+int opt_stats=0;
+const char* opt_stats_format="text";
 
 const char* opt_ensemble="strings";
 const char* opt_rhythm=nullptr;
+const char* opt_output=nullptr;
+const char* opt_midi_device=nullptr;
+const char* opt_capture=nullptr;
 
 const char* opt_transpose_to=nullptr;
 int opt_transpose_by=0;
 
+// bars committed in streaming mode which may wait for playback
+const static int stream_queue_bars=4;
+
+// progressions read ahead and voiced in parallel in batch mode
+const static int batch_block_lines=1024;
+
+// larger requests to the server are refused
+const static uint32_t max_request_size=65536;
+
+// how often the server checks for finished connections while none arrive, and how long it
+// waits before accepting again after running out of descriptors
+const static int accept_poll_ms=1000;
+const static long accept_backoff_ns=100000000;
+
 enum {
     ARG_LIST_MIDI=1,
     ARG_SHOW_VERSION
@@ -35,13 +91,31 @@ poptOption option_table[]={
     { NULL, 'p', POPT_ARG_NONE,     &opt_play,          0, "Play using MIDI output", NULL },
     { NULL, 'l', POPT_ARG_NONE,     &opt_loop,          0, "Loop endlessly", NULL },
     { NULL, 'e', POPT_ARG_NONE,     &opt_embellish,     0, "Apply embellishments to the harmony voices", NULL },
+    { "tie", 0, POPT_ARG_NONE,      &opt_tie,           0, "Hold harmony notes which stay the same in the next bar instead of striking them again", NULL },
     { NULL, 'i', POPT_ARG_NONE,     &opt_improvise,     0, "Improvise a melody", NULL },
     { NULL, 'B', POPT_ARG_INT,      &opt_bpm,           0, "Set tempo (beats per minute)", "BPM" },
     { NULL, 'E', POPT_ARG_STRING,   &opt_ensemble,      0, "Specify ensemble definition", "FILENAME" },
     { NULL, 'R', POPT_ARG_STRING,   &opt_rhythm,        0, "Specify rhythmic accompaniment definition", "FILENAME" },
     { NULL, 't', POPT_ARG_STRING,   &opt_transpose_to,  0, "Transpose such that the progression starts with a chord rooted on the given note", "NOTE" },
     { NULL, 'T', POPT_ARG_INT,      &opt_transpose_by,  0, "Play the progression transposed by the given number of semitones", "SEMITONES" },
+    { NULL, 'j', POPT_ARG_INT,      &opt_threads,       0, "Number of worker threads (default: one per CPU core)", "N" },
+    { "beam", 'b', POPT_ARG_INT,     &opt_beam_width,    0, "Use beam search, keeping the given number of partial voice leadings per bar", "WIDTH" },
+    { "best", 0, POPT_ARG_INT,      &opt_best,          0, "Print the given number of best voice leadings found by beam search", "N" },
+    { "compare-exact", 0, POPT_ARG_NONE, &opt_compare_exact, 0, "Report the optimality gap of beam search against the exact solver, together with --beam or --best", NULL },
+    { "voicing-cache", 0, POPT_ARG_NONE, &opt_voicing_cache, 0, "Keep enumerated voicings on disk for subsequent runs", NULL },
+    { "stream", 0, POPT_ARG_NONE,   &opt_stream,        0, "Read chords from standard input and voice and play them as they arrive", NULL },
+    { "lookahead", 0, POPT_ARG_INT, &opt_lookahead,     0, "Number of further chords to wait for before a voicing is committed in streaming mode (default: 4)", "BARS" },
+    { NULL, 'o', POPT_ARG_STRING,   &opt_output,        0, "Write the progression to a Standard MIDI File", "FILENAME" },
+    { "batch", 0, POPT_ARG_STRING,  &opt_batch,         0, "Voice one progression per line of the given file (- for standard input)", "FILENAME" },
+    { "batch-format", 0, POPT_ARG_STRING, &opt_batch_format, 0, "Output format of batch mode: json (one object per line, default) or tsv (one row per bar)", "FORMAT" },
+    { "serve", 0, POPT_ARG_STRING,  &opt_serve,         0, "Answer voicing requests on the given Unix domain socket", "SOCKET" },
+    { "stats", 0, POPT_ARG_NONE,    &opt_stats,         0, "Print timings and counters of the run to standard error", NULL },
+    { "stats-format", 0, POPT_ARG_STRING, &opt_stats_format, 0, "Format of the statistics: text (default) or json", "FORMAT" },
     { "midi-port", 0, POPT_ARG_INT, &opt_midi_port,     0, "Use the given MIDI out port", "PORT" },
+    { "midi-device", 0, POPT_ARG_STRING, &opt_midi_device, 0, "Write MIDI directly to the given raw MIDI device instead of a port", "DEVICE" },
+    { "capture", 0, POPT_ARG_STRING, &opt_capture,     0, "Play into a Standard MIDI File with the actual timing instead of a MIDI port", "FILENAME" },
+    { "spin", 0, POPT_ARG_INT,      &opt_spin,          0, "Busy-wait for the given time before each MIDI event for lower jitter", "USEC" },
+    { "realtime", 0, POPT_ARG_INT,  &opt_realtime,      0, "Run the MIDI output thread with real-time scheduling at the given priority and lock memory", "PRIORITY" },
     { "list-midi", 0, POPT_ARG_NONE, nullptr, ARG_LIST_MIDI, "List available MIDI devices/ports", NULL },
     { "version", 0, POPT_ARG_NONE,   nullptr, ARG_SHOW_VERSION, "Display version number", NULL },
     POPT_AUTOHELP
@@ -49,326 +123,815 @@ poptOption option_table[]={
 };
 
 
-struct Bar {
-    Chord               chord;
-    Scale               scale;
-    Ensemble::Voicing   voicing;
+Sequencer* seq=nullptr;
+
+void break_handler(int sig)
+{
+    const int saved_errno=errno;
+
+    signal(SIGINT, SIG_DFL);
+
+    if (seq)
+        seq->stop();
+
+    errno=saved_errno;
+}
+
+
+// makes seq unreachable for break_handler before the sequencer goes away
+struct ReleaseSequencer {
+    void operator()(Sequencer* sequencer) const
+    {
+        seq=nullptr;
+        delete sequencer;
+    }
 };
 
+typedef std::unique_ptr<Sequencer, ReleaseSequencer> SequencerPtr;
+
 
-int compute_voice_leading_cost(const Ensemble::Voicing& v1, const Ensemble::Voicing& v2)
+// The sequencer sends to midiout from its output thread until it is destroyed, so it must not
+// outlive midiout.
+SequencerPtr start_sequencer(MidiOut& midiout, int ticks_per_beat)
 {
-    const int n=v1.get_voice_count();
+    SequencerPtr sequencer(new Sequencer(midiout, opt_bpm, opt_transpose_by, ticks_per_beat));
+
+    sequencer->set_spin_time(opt_spin);
+    if (opt_play && opt_realtime>0 && !sequencer->set_realtime_priority(opt_realtime))
+        std::cerr << "Warning: could not enable real-time scheduling for MIDI output" << std::endl;
+
+    seq=sequencer.get();
+
+    return sequencer;
+}
 
-    int cost=0;
 
-    for (int i=0;i<n;i++) {
-        int v=v1[i].get_midi_note() - v2[i].get_midi_note();
-        cost+=v*v;
+void list_midi_ports()
+{
+    try {
+        RtMidiOut rtmidiout;
+
+        for (int i=0;i<rtmidiout.getPortCount();i++)
+            std::cout << i << ": " << rtmidiout.getPortName(i) << std::endl;
     }
+    catch (const RtMidiError& err) {
+        err.printMessage();
+    }
+}
 
-    for (int i=1;i<n;i++) {
-        for (int j=0;j<i;j++) {
-            int v=v1[i].get_midi_note() - v1[j].get_midi_note();
-            if (v%12!=0 && v%12!=7) continue;
 
-            if (v2[i].get_midi_note()==v2[j].get_midi_note()+v)
-                cost+=1000; // forbidden parallel
-        }
+std::string expand_home_directory(const std::string& path)
+{
+    if (path.size()>0 && path[0]=='~')
+        return std::string(getenv("HOME")) + path.substr(1);
+
+    return path;
+}
+
+
+std::ifstream open_resource_file(const char* category, const char* filename)
+{
+    std::ifstream file;
+
+    std::string resource_paths=RESOURCE_PATHS;
+    for (size_t i=0;!file.is_open();) {
+        size_t j=resource_paths.find_first_of(':', i);
+        std::string path=expand_home_directory(resource_paths.substr(i, j==std::string::npos ? j : j-i));
+
+        file.open(path + '/' + category + '/' + filename);
+
+        if (j==std::string::npos) break;
+        i=j+1;
     }
 
-    return cost;
+    return file;
 }
 
 
-void compute_voice_leading(const Ensemble& ensemble, std::vector<Bar>& bars)
+std::string get_voicing_cache_filename(const Ensemble& ensemble)
 {
-    struct pathnode_t {
-        Ensemble::Voicing   voicing;
-        int                 back;
-        int                 cost;
-    };
+    std::string path=expand_home_directory(CACHE_PATH);
+
+    // create the cache directory along with its parents
+    for (size_t i=path.find('/', 1);;i=path.find('/', i+1)) {
+        mkdir(path.substr(0, i).c_str(), 0755);
+        if (i==std::string::npos) break;
+    }
+
+    char filename[32];
+    snprintf(filename, sizeof(filename), "/voicings-%016llx", (unsigned long long) ensemble.get_fingerprint());
+
+    return path + filename;
+}
 
-    std::vector<std::vector<pathnode_t>> pathnodes;
 
-    for (const Bar& bar: bars) {
-        std::vector<pathnode_t> voicings;
+void print_diagnostics(const char* what, const char* name, const std::vector<ParseDiagnostic>& diagnostics)
+{
+    for (const auto& diag: diagnostics)
+        std::cerr << "Error parsing " << what << " " << name << ", " << diag << std::endl;
+}
 
-        for (Ensemble::Voicing& v: ensemble.enumerate_harmony_voicings(bar.chord))
-            voicings.push_back(pathnode_t { std::move(v), -1, 0 });
 
-        pathnodes.push_back(std::move(voicings));
+bool load_ensemble(const char* name, Ensemble& ensemble)
+{
+    std::ifstream ensemblestream=open_resource_file("ensembles", name);
+    if (!ensemblestream.is_open()) {
+        std::cerr << "Error: could not read ensemble definition " << name << std::endl;
+        return false;
     }
 
-    for (int i=1;i<pathnodes.size();i++) {
-        for (int j=0;j<pathnodes[i].size();j++) {
-            pathnodes[i][j].cost=INT_MAX;
+    std::vector<ParseDiagnostic> diagnostics;
 
-            for (int k=0;k<pathnodes[i-1].size();k++) {
-                int cost=pathnodes[i-1][k].cost + compute_voice_leading_cost(pathnodes[i-1][k].voicing, pathnodes[i][j].voicing);
+    EnsembleParser parseensemble;
+    ensemble=parseensemble(ensemblestream, diagnostics);
+    if (!diagnostics.empty()) {
+        print_diagnostics("ensemble definition", name, diagnostics);
+        return false;
+    }
 
-                if (opt_loop && i+1==pathnodes.size()) {
-                    int i0=i-1, k0=k;
-                    while (i0>0)
-                        k0=pathnodes[i0--][k0].back;
+    return true;
+}
 
-                    cost+=compute_voice_leading_cost(pathnodes[i][j].voicing, pathnodes[i0][k0].voicing);
-                }
 
-                if (cost<pathnodes[i][j].cost) {
-                    pathnodes[i][j].cost=cost;
-                    pathnodes[i][j].back=k;
-                }
+// picks the first synthesizer if no port was given
+bool open_midi_port(RtMidiOut& rtmidiout)
+{
+    if (opt_midi_port<0) {
+        const int numports=rtmidiout.getPortCount();
+
+        for (int i=0;i<numports;i++) {
+            std::string portname=rtmidiout.getPortName(i).c_str();
+            std::transform(portname.begin(), portname.end(), portname.begin(), tolower);
+            if (portname.find("synth")!=std::string::npos || portname.find("timidity")!=std::string::npos) {
+                opt_midi_port=i;
+                break;
             }
         }
+
+        if (opt_midi_port<0) {
+            std::cerr << "Error: No MIDI synth found" << std::endl;
+            return false;
+        }
     }
 
-    int bestcost=INT_MAX;
-    int best=0;
+    rtmidiout.openPort(opt_midi_port);
 
-    int i=pathnodes.size()-1;
-    for (int j=0;j<pathnodes[i].size();j++) {
-        if (pathnodes[i][j].cost<bestcost) {
-            bestcost=pathnodes[i][j].cost;
-            best=j;
+    return true;
+}
+
+
+// the raw device given with --midi-device, the file given with --capture, or else an RtMidi port
+std::unique_ptr<MidiSink> open_midi_sink(std::unique_ptr<RtMidiOut>& rtmidiout)
+{
+    if (opt_midi_device) {
+        const int fd=open(opt_midi_device, O_WRONLY);
+        if (fd<0) {
+            std::cerr << "Error: could not open MIDI device " << opt_midi_device << std::endl;
+            return nullptr;
         }
+
+        return std::unique_ptr<MidiSink>(new RawMidiSink(fd));
     }
 
-    int j=best;
+    if (opt_capture)
+        return std::unique_ptr<MidiSink>(new SmfMidiSink(opt_capture));
+
+    rtmidiout.reset(new RtMidiOut());
+    if (!open_midi_port(*rtmidiout))
+        return nullptr;
+
+    return std::unique_ptr<MidiSink>(new RtMidiSink(*rtmidiout));
+}
+
+
+void close_midi_sink(MidiSink& sink)
+{
+    if (!sink.close())
+        std::cerr << "Error: could not deliver all MIDI output" << std::endl;
+}
+
+
+// at the end of a run with --stats
+void print_stats()
+{
+    if (!opt_stats) return;
 
-    while (i>=0) {
-        bars[i].voicing=std::move(pathnodes[i][j].voicing);
-        j=pathnodes[i--][j].back;
+    if (!strcmp(opt_stats_format, "json"))
+        std::cerr << Stats::get_json() << std::endl;
+    else
+        Stats::print(std::cerr);
+}
+
+
+// also adds the lateness to the statistics of --stats
+void print_lateness_stats(const Sequencer& seq)
+{
+    const auto& stats=seq.get_lateness_stats();
+    if (!stats.events) return;
+
+    Stats::add(Stats::Counter::EventsPlayed, stats.events);
+    Stats::add(Stats::Counter::LateEvents, stats.over_1ms);
+    Stats::add(Stats::Counter::LatenessTotal, stats.total_ns);
+    Stats::max(Stats::Counter::LatenessMax, stats.max_ns);
+
+    fprintf(stderr, "Timing: %ld events, lateness mean %.1f us, max %.1f us, %ld over 1 ms, %ld resyncs\n",
+            stats.events, stats.total_ns*1e-3/stats.events, stats.max_ns*1e-3, stats.over_1ms, stats.resyncs);
+}
+
+
+// Splits standard input into whitespace separated tokens.  While waiting for input, stop is
+// checked regularly, so that a thread reading the input can be stopped and joined.
+class InputTokenizer {
+public:
+    bool next(std::string& token, const std::atomic<bool>& stop);
+
+private:
+    const static int poll_ms=100;
+
+    std::string buffer;
+    size_t      pos=0;
+    bool        eof=false;
+};
+
+
+bool InputTokenizer::next(std::string& token, const std::atomic<bool>& stop)
+{
+    for (;;) {
+        while (pos<buffer.size() && isspace(uint8_t(buffer[pos])))
+            pos++;
+
+        size_t end=pos;
+        while (end<buffer.size() && !isspace(uint8_t(buffer[end])))
+            end++;
+
+        // a token is complete once followed by whitespace or the end of the input
+        if (end>pos && (end<buffer.size() || eof)) {
+            token.assign(buffer, pos, end-pos);
+            pos=end;
+            return true;
+        }
+
+        if (eof) return false;
+
+        buffer.erase(0, pos);
+        pos=0;
+
+        pollfd pfd { STDIN_FILENO, POLLIN, 0 };
+        const int ready=poll(&pfd, 1, poll_ms);
+        if (stop) return false;
+
+        if (ready<0 && errno!=EINTR) return false;
+        if (ready<=0) continue;
+
+        char data[4096];
+        const ssize_t n=read(STDIN_FILENO, data, sizeof(data));
+        if (n<0 && errno==EINTR) continue;
+
+        if (n<=0)
+            eof=true;
+        else
+            buffer.append(data, n);
     }
 }
 
 
-std::vector<Note> improvise_melody(const std::vector<Bar>& bars, const Ensemble::Voice& melvoice)
+/*
+ * Streaming mode: chords are read from standard input, and each bar is printed as soon as
+ * its voicing is committed.  When playing, a reader thread parses and voices the input while
+ * the main thread plays one bar at a time, so playback starts after the first few bars and
+ * neither side holds more than a few bars.  A bar is played once the next one is known, for
+ * the embellishments.
+ */
+int stream_chords(const Ensemble& ensemble, const Rhythm& rhythm, VoicingCache& voicingcache, ThreadPool& threadpool, const ProgressionOptions& options)
 {
-    std::vector<Note> melody;
-    std::vector<std::vector<Note>> noteset;
+    StreamingVoiceLeading streamer(voicingcache, threadpool, opt_lookahead);
+    BoundedQueue<Bar> queue(stream_queue_bars);
+
+    auto emit=[&](Bar& bar) {
+        ensemble.print_harmony_voicing(bar.chord, bar.scale, bar.voicing);
+        return !opt_play || queue.push(std::move(bar));
+    };
 
-    const int n=bars.size()*2 - 1;
+    // set when playback was interrupted, so that the reader does not wait for more input
+    std::atomic<bool> stop(false);
 
-    for (int i=0;i<n;i++) {
-        const Chord& chord=bars[i/2].chord;
+    auto produce=[&]() {
+        ChordParser parsechord;
+        InputTokenizer input;
+        std::optional<Interval> trans;
+        std::string token;
 
-        Note initial_note;
+        while (input.next(token, stop)) {
+            auto chord=parsechord(token.c_str());
+            if (!chord.has_value()) {
+                std::cerr << "Error: invalid chord '" << token << "'" << std::endl;
+                continue;
+            }
 
-        std::vector<Note> notes;
-        for (int j=0;j<6 && chord.notes[j];j++) {
-            for (int k=0;k<10;k++) {
-                Note note(chord.notes[j], k);
-                if (note<melvoice.range_low) continue;
-                if (note>melvoice.range_high) break;
+            Stats::add(Stats::Counter::ChordsParsed, 1);
 
-                if (!j && !initial_note)
-                    initial_note=note;
+            if (options.transpose_to) {
+                if (!trans)
+                    trans=*options.transpose_to - chord->notes[0];
 
-                notes.push_back(note);
+                *chord+=*trans;
             }
+
+            for (Bar& bar: streamer.push(*chord))
+                if (!emit(bar)) return;
         }
 
-        noteset.push_back(std::move(notes));
-        melody.push_back(initial_note);
-    }
+        if (stop) return;
 
-    struct NoteCandidate {
-        Note    note;
-        float   cumul;
+        for (Bar& bar: streamer.finish())
+            if (!emit(bar)) return;
+
+        queue.close();
     };
 
-    srand(time(nullptr));
+    if (!opt_play) {
+        produce();
+        return 0;
+    }
+
+    signal(SIGINT, break_handler);
 
-    for (int pass=0;pass<10;pass++) {
-        for (int i=1;i+1<n;i++) {
-            std::vector<NoteCandidate> candidates;
-            float cumul=0.0f;
+    try {
+        std::unique_ptr<RtMidiOut> rtmidiout;
+        std::unique_ptr<MidiSink> sink=open_midi_sink(rtmidiout);
+        if (!sink)
+            return 1;
 
-            for (const Note& note: noteset[i]) {
-                auto Pr=[](int d) { return expf(-0.75f*abs(d))*abs(d); };
+        MidiOut midiout(*sink);
 
-                float prob=Pr(note.get_midi_note() - melody[i-1].get_midi_note()) * Pr(note.get_midi_note() - melody[i+1].get_midi_note());
-                //printf("%s %s %s: %f (%f)\n", melody[i-1].get_name().c_str(), note.get_name().c_str(), melody[i+1].get_name().c_str(), prob, cumul);
+        SequencerPtr sequencer=start_sequencer(midiout, compute_ticks_per_beat(rhythm));
 
-                NoteCandidate nc;
-                nc.note=note;
-                nc.cumul=cumul;
-                cumul+=prob;
+        const BarTracks tracks=add_bar_tracks(*sequencer, ensemble, rhythm, options);
 
-                candidates.push_back(nc);
+        ensemble.init_midi_programs(*sequencer);
+
+        std::thread reader(produce);
+
+        Bar cur, next;
+        bool more=queue.pop(cur);
+
+        while (more) {
+            more=queue.pop(next);
+
+            {
+                Stats::ScopedTimer timer(Stats::Timer::Render);
+
+                render_bar(tracks, ensemble, rhythm, cur, more ? &next : nullptr, 0, false, options);
+
+                for (auto* track: tracks.all)
+                    track->append_pause(4*tracks.ticks_per_beat);
             }
 
-            float v=cumul * ldexpf(rand()&0xfffff, -20);
-            int c=0;
-            while (c+1<candidates.size() && candidates[c+1].cumul<=v) c++;
+            // keep one bar scheduled ahead of the one playing
+            const long previous=sequencer->get_scheduled_count();
+
+            if (!sequencer->schedule() || !sequencer->wait_played(previous)) {
+                sequencer->finish();
+                print_lateness_stats(*sequencer);
+                close_midi_sink(*sink);
 
-            //printf("total=%f  v=%f  c=%d\n", cumul, v, c);
+                // wakes up the reader if it waits for input or for room in the queue
+                stop=true;
+                queue.close();
+                reader.join();
+                return 0;
+            }
 
-            melody[i]=candidates[c].note;
+            sequencer->clear();
+            cur=std::move(next);
         }
+
+        reader.join();
+
+        sequencer->finish();
+        print_lateness_stats(*sequencer);
+        close_midi_sink(*sink);
+    }
+    catch (const RtMidiError& err) {
+        err.printMessage();
     }
 
-    return melody;
+    return 0;
 }
 
 
-std::vector<Note> improvise_passing_notes(const std::vector<Note>& in_melody, const std::vector<Bar>& bars)
+// Voices the progression given on one line of a batch and formats the result, or an error
+// for an invalid chord.  Returns false in the latter case.
+bool voice_batch_line(const Ensemble& ensemble, VoicingCache& voicingcache, ThreadPool& threadpool, const ProgressionOptions& options, long lineno, const std::string& line, bool tsv, std::string& output)
 {
-    std::vector<Note> melody;
+    std::vector<Chord> chords;
+    std::string error;
 
-    for (int i=0;i+1<in_melody.size();i++) {
-        const Scale& scale=bars[i/2].scale;
+    if (!parse_progression(line, options, chords, error)) {
+        if (tsv)
+            output=std::to_string(lineno) + "\terror\t" + error + "\n";
+        else
+            output="{\"line\":" + std::to_string(lineno) + ",\"error\":" + json_quote(error) + "}\n";
 
-        melody.push_back(in_melody[i]);
+        return false;
+    }
 
-        int8_t prev=scale.to_scale(in_melody[i]);
-        int8_t next=scale.to_scale(in_melody[i+1]);
+    std::vector<Bar> bars(chords.size());
+    for (int i=0;i<chords.size();i++)
+        bars[i].chord=chords[i];
 
-        switch (next-prev) {
-        case -3:
-        case -2:
-            melody.push_back(scale(prev-1));
-            break;
-        case -4:
-        case -1:
-            melody.push_back(scale(prev-2));
-            break;
-        case 1:
-        case 4:
-            melody.push_back(scale(prev+2));
-            break;
-        case 0:
-        case 2:
-        case 3:
-            melody.push_back(scale(prev+1));
-            break;
-        default:
-            melody.push_back(in_melody[i]);
+    const int cost=voice_progression(voicingcache, threadpool, bars, options);
+
+    if (tsv) {
+        for (int i=0;i<bars.size();i++) {
+            output+=std::to_string(lineno) + '\t' + std::to_string(i) + '\t' + bars[i].chord.get_name() + '\t' + bars[i].scale.get_name();
+
+            for (int j=0;j<ensemble.get_harmony_voice_count();j++)
+                output+='\t' + get_plain_note_name(bars[i].voicing[j]);
+
+            output+='\n';
         }
     }
+    else {
+        output="{\"line\":" + std::to_string(lineno) + ',';
+        append_progression_json(ensemble, bars, cost, output);
+        output+="}\n";
+    }
 
-    melody.push_back(in_melody.back());
-
-    return melody;
+    return true;
 }
 
 
-void compute_scales_for_chords(std::vector<Bar>& bars)
+/*
+ * Batch mode: every non-empty line of the input is a progression, which is voiced on its own
+ * and written to standard output in a machine-readable format, in the order of the input.
+ * Blocks of lines are voiced in parallel, one progression per pool thread, while the ensemble,
+ * the parsers and the voicing cache are shared by all of them.
+ */
+int batch_chords(const Ensemble& ensemble, VoicingCache& voicingcache, ThreadPool& threadpool, const ProgressionOptions& options)
 {
-    const int n=bars.size();
+    const bool tsv=!strcmp(opt_batch_format, "tsv");
+    if (!tsv && strcmp(opt_batch_format, "json")) {
+        std::cerr << "Error: unknown batch format " << opt_batch_format << std::endl;
+        return 1;
+    }
 
-    struct node_t {
-        Scale   scale;
-        int     nonchordtones;
-        int     cost;
-        int     back;
-    };
+    std::ifstream file;
+    if (strcmp(opt_batch, "-")) {
+        file.open(opt_batch);
+        if (!file.is_open()) {
+            std::cerr << "Error: could not read " << opt_batch << std::endl;
+            return 1;
+        }
+    }
 
-    node_t* nodes=new node_t[n*7];
-    for (int i=0;i<n;i++) {
-        const Chord& chord=bars[i].chord;
+    std::istream& input=file.is_open() ? file : std::cin;
 
-        for (int j=0;j<7;j++) {
-            nodes[i*7+j].scale=Scale(chord.notes[0], Scale::Mode(j));
-            nodes[i*7+j].nonchordtones=0;
+    const int64_t starttime=get_monotonic_time();
+    long progressions=0, invalid=0, lineno=0;
 
-            for (int k=0;k<6 && chord.notes[k];k++)
-                if (!nodes[i*7+j].scale.contains(chord.notes[k]))
-                    nodes[i*7+j].nonchordtones++;
-        }
-    }
+    std::vector<long> linenos;
+    std::vector<std::string> lines, outputs;
+    std::vector<char> valid;
+
+    for (bool more=true;more;) {
+        lines.clear();
+        linenos.clear();
 
-    Scale alleged_tonic_scale(bars[0].chord.notes[0], bars[0].chord.quality==Chord::Quality::Minor ? Scale::Mode::Aeolian : Scale::Mode::Ionian);
-
-    for (int j=0;j<7;j++) {
-        nodes[j].cost=nodes[j].nonchordtones*16 + Scale::distance(alleged_tonic_scale, nodes[j].scale);
-        nodes[j].back=-1;
-    }
-
-    for (int i=1;i<n;i++) {
-        for (int j=0;j<7;j++) {
-            nodes[i*7+j].cost=INT_MAX;
-            nodes[i*7+j].back=0;
-
-            for (int k=0;k<7;k++) {
-                int cost=nodes[(i-1)*7+k].cost + nodes[i*7+j].nonchordtones*16;
-                int dist=Scale::distance(nodes[(i-1)*7+k].scale, nodes[i*7+j].scale);
-                if (dist)
-                    cost+=dist+1;
-
-                // check if we already had the same chord earlier in the progression -- if so, try to use the same scale
-                for (int p=i-1, q=k; p>=0; q=nodes[p--*7+q].back) {
-                    if (bars[i].chord==bars[p].chord) {
-                        if (nodes[i*7+j].scale!=nodes[p*7+q].scale)
-                            cost+=3;
-                        
-                        break;
-                    }
-                }
-                
-                if (cost<nodes[i*7+j].cost) {
-                    nodes[i*7+j].cost=cost;
-                    nodes[i*7+j].back=k;
-                }
+        std::string line;
+        while (lines.size()<batch_block_lines && (more=bool(getline(input, line)))) {
+            lineno++;
+
+            if (line.find_first_not_of(" \t\r")!=std::string::npos) {
+                lines.push_back(std::move(line));
+                linenos.push_back(lineno);
             }
         }
+
+        outputs.assign(lines.size(), std::string());
+        valid.assign(lines.size(), 0);
+
+        threadpool.parallel_for(lines.size(), 1, [&](int begin, int end) {
+            for (int i=begin;i<end;i++)
+                valid[i]=voice_batch_line(ensemble, voicingcache, threadpool, options, linenos[i], lines[i], tsv, outputs[i]);
+        });
+
+        for (int i=0;i<lines.size();i++) {
+            std::cout << outputs[i];
+
+            progressions++;
+            if (!valid[i]) invalid++;
+        }
     }
 
+    std::cout.flush();
 
-    int bestscale=0;
-    for (int j=0;j<7;j++)
-        if (nodes[(n-1)*7+j].cost < nodes[(n-1)*7+bestscale].cost)
-            bestscale=j;
-    
-    for (int i=n-1;i>=0;bestscale=nodes[i--*7+bestscale].back)
-        bars[i].scale=nodes[i*7+bestscale].scale;
+    const double seconds=(get_monotonic_time()-starttime)*1e-9;
+    fprintf(stderr, "Batch: %ld progressions (%ld invalid) in %.3f s, %.1f progressions/s\n",
+            progressions, invalid, seconds, seconds>0 ? progressions/seconds : 0.0);
+
+    return 0;
 }
 
 
-Sequencer* seq=nullptr;
+/*
+ * Server mode answers requests to voice a progression on a Unix domain socket.  Messages in
+ * both directions are framed by their length as a 32-bit big-endian number.  A request holds
+ * the chord names separated by spaces, optionally preceded by @ENSEMBLE to use another than
+ * the default ensemble, and is answered by a JSON object as in batch mode, or one with an
+ * error member.
+ *
+ * Ensembles and their voicing caches are loaded on first use and kept for all connections.
+ * Each connection is served by its own thread and keeps a ProgressionSolver for the last
+ * progression, so a request which only changes a few chords of the previous one, as when
+ * editing, only redoes the affected part of the dynamic program.  When the server quits, it
+ * shuts down all connections and waits for their threads, which use the ensembles, caches
+ * and thread pool owned by the caller.
+ */
+class VoicingServer {
+public:
+    VoicingServer(const Ensemble& ensemble, VoicingCache& voicingcache, ThreadPool& threadpool, const ProgressionOptions& options):defaultensemble(ensemble), defaultcache(voicingcache), threadpool(threadpool), options(options) {}
+
+    int run(const char* path);
+
+private:
+    struct ServedEnsemble {
+        Ensemble                        ensemble;
+        std::unique_ptr<VoicingCache>   voicingcache;
+    };
 
-void break_handler(int sig)
+    struct Connection {
+        int                 fd;
+        std::thread         thread;
+        std::atomic<bool>   done { false };
+    };
+
+    struct Session {
+        std::string                         ensemblename;
+        std::vector<Chord>                  chords;
+        std::unique_ptr<ProgressionSolver>  solver;
+    };
+
+    void serve_connection(Connection&);
+    void join_connections(bool all);
+    std::string answer(Session&, const std::string& request);
+    bool get_ensemble(const std::string& name, const Ensemble*& ensemble, VoicingCache*& voicingcache);
+
+    const Ensemble&     defaultensemble;
+    VoicingCache&       defaultcache;
+    ThreadPool&         threadpool;
+    const ProgressionOptions    options;
+
+    std::mutex          ensemblemutex;
+    std::map<std::string, std::unique_ptr<ServedEnsemble>>  ensembles;
+
+    // only used by the accepting thread
+    std::list<Connection>   connections;
+};
+
+
+static volatile sig_atomic_t server_quit=0;
+
+void server_quit_handler(int)
 {
-    signal(SIGINT, SIG_DFL);
+    server_quit=1;
+}
 
-    if (seq)
-        seq->stop();
+
+static bool read_fully(int fd, void* data, size_t size)
+{
+    for (size_t done=0;done<size;) {
+        const ssize_t n=read(fd, (char*) data+done, size-done);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) return false;
+
+        done+=n;
+    }
+
+    return true;
 }
 
 
-void list_midi_ports()
+static bool write_fully(int fd, const void* data, size_t size)
 {
-    try {
-        RtMidiOut rtmidiout;
+    for (size_t done=0;done<size;) {
+        const ssize_t n=send(fd, (const char*) data+done, size-done, MSG_NOSIGNAL);
+        if (n<0 && errno==EINTR) continue;
+        if (n<=0) return false;
 
-        for (int i=0;i<rtmidiout.getPortCount();i++)
-            std::cout << i << ": " << rtmidiout.getPortName(i) << std::endl;
+        done+=n;
     }
-    catch (const RtMidiError& err) {
-        err.printMessage();
+
+    return true;
+}
+
+
+// Chord::operator== only compares the notes, but e.g. C6 and C+13 have different voicing
+// tables, and the quality is part of the name in the answer
+static bool is_same_chord(const Chord& a, const Chord& b)
+{
+    return a==b && a.required==b.required && a.quality==b.quality;
+}
+
+
+bool VoicingServer::get_ensemble(const std::string& name, const Ensemble*& ensemble, VoicingCache*& voicingcache)
+{
+    if (name.empty() || name==opt_ensemble) {
+        ensemble=&defaultensemble;
+        voicingcache=&defaultcache;
+        return true;
     }
+
+    // only the plain names of the ensembles in the resource paths, not paths to other files
+    if (name.find('/')!=std::string::npos || name[0]=='.')
+        return false;
+
+    std::lock_guard<std::mutex> lock(ensemblemutex);
+
+    auto& served=ensembles[name];
+    if (!served) {
+        std::unique_ptr<ServedEnsemble> loaded(new ServedEnsemble);
+        if (!load_ensemble(name.c_str(), loaded->ensemble)) {
+            ensembles.erase(name);
+            return false;
+        }
+
+        loaded->voicingcache.reset(new VoicingCache(loaded->ensemble));
+        served=std::move(loaded);
+    }
+
+    ensemble=&served->ensemble;
+    voicingcache=served->voicingcache.get();
+    return true;
 }
 
 
-std::ifstream open_resource_file(const char* category, const char* filename)
+std::string VoicingServer::answer(Session& session, const std::string& request)
 {
-    std::ifstream file;
+    std::string ensemblename, progression=request;
+    if (!request.empty() && request[0]=='@') {
+        const size_t end=request.find_first_of(" \t\n");
+        ensemblename=request.substr(1, end==std::string::npos ? end : end-1);
+        progression=end==std::string::npos ? std::string() : request.substr(end);
+    }
 
-    std::string resource_paths=RESOURCE_PATHS;
-    for (size_t i=0;!file.is_open();) {
-        size_t j=resource_paths.find_first_of(':', i);
-        std::string path=resource_paths.substr(i, j==std::string::npos ? j : j-i);
-        if (path.size()>0 && path[0]=='~')
-            path=std::string(getenv("HOME")) + path.substr(1);
-            
-        file.open(path + '/' + category + '/' + filename);
+    std::vector<Chord> chords;
+    std::string error;
 
-        if (j==std::string::npos) break;
-        i=j+1;
+    const Ensemble* ensemble;
+    VoicingCache* voicingcache;
+
+    if (!get_ensemble(ensemblename, ensemble, voicingcache))
+        error="unknown ensemble '" + ensemblename + "'";
+    else if (parse_progression(progression, options, chords, error) && chords.empty())
+        error="no chords given";
+
+    if (!error.empty())
+        return "{\"error\":" + json_quote(error) + "}";
+
+    // keep the tables of the previous request if only some of its chords changed
+    if (session.solver && session.ensemblename==ensemblename && session.chords.size()==chords.size()) {
+        for (int i=0;i<chords.size();i++)
+            if (!is_same_chord(chords[i], session.chords[i]))
+                session.solver->replace_chord(i, chords[i]);
+    }
+    else {
+        session.solver.reset(new ProgressionSolver(*voicingcache, threadpool, chords, options.loop));
+        session.ensemblename=ensemblename;
     }
 
-    return file;
+    session.chords=std::move(chords);
+
+    const int cost=session.solver->solve();
+
+    std::string output="{";
+    append_progression_json(*ensemble, session.solver->get_bars(), cost, output);
+    output+='}';
+
+    return output;
+}
+
+
+// the socket is closed by join_connections, so that it cannot be reused while still shut down
+void VoicingServer::serve_connection(Connection& connection)
+{
+    const int fd=connection.fd;
+    Session session;
+    std::string request;
+
+    for (;;) {
+        uint8_t header[4];
+        if (!read_fully(fd, header, sizeof(header)))
+            break;
+
+        const uint32_t size=uint32_t(header[0])<<24 | uint32_t(header[1])<<16 | uint32_t(header[2])<<8 | header[3];
+        if (size>max_request_size)
+            break;
+
+        request.resize(size);
+        if (!read_fully(fd, &request[0], size))
+            break;
+
+        const std::string response=answer(session, request);
+
+        const uint32_t length=response.size();
+        const uint8_t lengthbytes[4]={ uint8_t(length>>24), uint8_t(length>>16), uint8_t(length>>8), uint8_t(length) };
+
+        if (!write_fully(fd, lengthbytes, sizeof(lengthbytes)) || !write_fully(fd, response.data(), response.size()))
+            break;
+    }
+
+    connection.done=true;
+}
+
+
+// Joins the threads of the finished connections, or of all after shutting down their sockets,
+// which makes them return from waiting for a request.
+void VoicingServer::join_connections(bool all)
+{
+    for (auto i=connections.begin();i!=connections.end();) {
+        if (all)
+            shutdown(i->fd, SHUT_RDWR);
+        else if (!i->done) {
+            ++i;
+            continue;
+        }
+
+        i->thread.join();
+        close(i->fd);
+        i=connections.erase(i);
+    }
+}
+
+
+int VoicingServer::run(const char* path)
+{
+    sockaddr_un addr {};
+    addr.sun_family=AF_UNIX;
+
+    if (strlen(path)>=sizeof(addr.sun_path)) {
+        std::cerr << "Error: socket path too long" << std::endl;
+        return 1;
+    }
+
+    strcpy(addr.sun_path, path);
+
+    const int listenfd=socket(AF_UNIX, SOCK_STREAM, 0);
+
+    // a socket left behind by a previous server would make bind fail
+    struct stat st;
+    if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    if (listenfd<0 || bind(listenfd, (const sockaddr*) &addr, sizeof(addr)) || listen(listenfd, 16)) {
+        std::cerr << "Error: could not listen on " << path << std::endl;
+        return 1;
+    }
+
+    // without SA_RESTART, so that accept returns when interrupted
+    struct sigaction action {};
+    action.sa_handler=server_quit_handler;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    int result=0;
+
+    while (!server_quit) {
+        join_connections(false);
+
+        // wake up now and then to join finished connections and to notice a missed signal
+        pollfd pfd { listenfd, POLLIN, 0 };
+        if (poll(&pfd, 1, accept_poll_ms)<=0)
+            continue;
+
+        const int fd=accept(listenfd, nullptr, nullptr);
+        if (fd<0) {
+            if (errno==EINTR || errno==ECONNABORTED)
+                continue;
+
+            // out of descriptors or memory, which connections ending may give back
+            if (errno==EMFILE || errno==ENFILE || errno==ENOBUFS || errno==ENOMEM) {
+                const timespec ts { 0, accept_backoff_ns };
+                nanosleep(&ts, nullptr);
+                continue;
+            }
+
+            std::cerr << "Error: could not accept connections on " << path << std::endl;
+            result=1;
+            break;
+        }
+
+        connections.emplace_back();
+        connections.back().fd=fd;
+        connections.back().thread=std::thread(&VoicingServer::serve_connection, this, std::ref(connections.back()));
+    }
+
+    join_connections(true);
+
+    close(listenfd);
+    unlink(path);
+
+    return result;
 }
 
 
@@ -388,42 +951,96 @@ int main(int argc, const char* argv[])
         }
     }
 
+    if (opt_stats) {
+        if (strcmp(opt_stats_format, "text") && strcmp(opt_stats_format, "json")) {
+            std::cerr << "Error: unknown statistics format " << opt_stats_format << std::endl;
+            return 1;
+        }
+
+        Stats::enable();
+    }
+
     ChordParser parsechord;
     std::vector<Bar> bars;
 
-    while (const char* arg=poptGetArg(pctx)) {
-        auto chord=parsechord(arg);
-        if (!chord.has_value()) {
-            printf("Error: invalid chord '%s'\n", arg);
-            return 1;
+    {
+        Stats::ScopedTimer timer(Stats::Timer::Parse);
+
+        while (const char* arg=poptGetArg(pctx)) {
+            auto chord=parsechord(arg);
+            if (!chord.has_value()) {
+                printf("Error: invalid chord '%s'\n", arg);
+                return 1;
+            }
+
+            Bar bar;
+            bar.chord=*chord;
+
+            bars.push_back(std::move(bar));
         }
 
-        Bar bar;
-        bar.chord=*chord;
+        Stats::add(Stats::Counter::ChordsParsed, bars.size());
+    }
 
-        bars.push_back(std::move(bar));
+    if (opt_compare_exact && opt_beam_width<=0 && opt_best<=1) {
+        std::cerr << "Error: --compare-exact requires --beam or --best" << std::endl;
+        return 1;
     }
 
-    if (bars.empty()) {
+    if (opt_stream) {
+        if (!bars.empty()) {
+            std::cerr << "Error: chords are read from standard input in streaming mode" << std::endl;
+            return 1;
+        }
+
+        if (opt_loop || opt_improvise || opt_output || opt_batch || opt_serve || opt_beam_width>0 || opt_best>1) {
+            std::cerr << "Error: --stream cannot be combined with -l, -i, -o, --batch, --serve, --beam or --best" << std::endl;
+            return 1;
+        }
+    }
+    else if (opt_serve) {
+        if (!bars.empty() || opt_batch || opt_play || opt_improvise || opt_output || opt_beam_width>0 || opt_best>1) {
+            std::cerr << "Error: --serve cannot be combined with chords, --batch, -p, -i, -o, --beam or --best" << std::endl;
+            return 1;
+        }
+    }
+    else if (opt_batch) {
+        if (!bars.empty()) {
+            std::cerr << "Error: progressions are read from the batch file in batch mode" << std::endl;
+            return 1;
+        }
+
+        if (opt_play || opt_improvise || opt_output || opt_beam_width>0 || opt_best>1) {
+            std::cerr << "Error: --batch cannot be combined with -p, -i, -o, --beam or --best" << std::endl;
+            return 1;
+        }
+    }
+    else if (bars.empty()) {
         poptPrintUsage(pctx, stderr, 0);
         std::cerr << "Error: no chords given" << std::endl;
         return 1;
     }
 
-    if (opt_transpose_to) {
-        Interval trans=NoteClass(opt_transpose_to) - bars[0].chord.notes[0];
+    ProgressionOptions options;
+    options.loop=opt_loop;
+    options.embellish=opt_embellish;
+    options.tie=opt_tie;
+    options.improvise=opt_improvise;
+    options.seed=time(nullptr);
+    if (opt_transpose_to)
+        options.transpose_to=NoteClass(opt_transpose_to);
+
+    if (options.transpose_to && !bars.empty()) {
+        Interval trans=*options.transpose_to - bars[0].chord.notes[0];
         for (auto& b: bars)
             b.chord+=trans;
     }
 
-    std::ifstream ensemblestream=open_resource_file("ensembles", opt_ensemble);
-    if (!ensemblestream.is_open()) {
-        std::cerr << "Error: could not read ensemble definition " << opt_ensemble << std::endl;
+    Ensemble ensemble;
+    if (!load_ensemble(opt_ensemble, ensemble))
         return 1;
-    }
-    
-    EnsembleParser parseensemble;
-    Ensemble ensemble=parseensemble(ensemblestream);
+
+    std::vector<ParseDiagnostic> diagnostics;
 
 
     Rhythm rhythm;
@@ -435,140 +1052,125 @@ int main(int argc, const char* argv[])
         }
 
         RhythmParser rhythmparser;
-        rhythm=rhythmparser(rhythmstream);
+        rhythm=rhythmparser(rhythmstream, diagnostics);
+        if (!diagnostics.empty()) {
+            print_diagnostics("rhythm definition", opt_rhythm, diagnostics);
+            return 1;
+        }
     }
 
 
-    compute_voice_leading(ensemble, bars);
-    compute_scales_for_chords(bars);
+    VoicingCache voicingcache(ensemble);
 
-    for (int i=0;i<bars.size();i++)
-        ensemble.print_harmony_voicing(bars[i].chord, bars[i].scale, bars[i].voicing);
-    
-    if (opt_play) {
-        signal(SIGINT, break_handler);
+    std::string voicing_cache_filename;
+    if (opt_voicing_cache) {
+        voicing_cache_filename=get_voicing_cache_filename(ensemble);
+        voicingcache.load(voicing_cache_filename);
+    }
 
-        try {
-            RtMidiOut rtmidiout;
-
-            if (opt_midi_port<0) {
-                const int numports=rtmidiout.getPortCount();
-
-                for (int i=0;i<numports;i++) {
-                    std::string portname=rtmidiout.getPortName(i).c_str();
-                    std::transform(portname.begin(), portname.end(), portname.begin(), tolower);
-                    if (portname.find("synth")!=std::string::npos || portname.find("timidity")!=std::string::npos) {
-                        opt_midi_port=i;
-                        break;
-                    }
-                }
-
-                if (opt_midi_port<0) {
-                    std::cerr << "Error: No MIDI synth found" << std::endl;
-                    return 1;
-                }
-            }
+    ThreadPool threadpool(opt_threads);
 
-            rtmidiout.openPort(opt_midi_port);
+    if (opt_stream || opt_batch || opt_serve) {
+        int result;
+        if (opt_stream)
+            result=stream_chords(ensemble, rhythm, voicingcache, threadpool, options);
+        else if (opt_batch)
+            result=batch_chords(ensemble, voicingcache, threadpool, options);
+        else
+            result=VoicingServer(ensemble, voicingcache, threadpool, options).run(opt_serve);
 
-            MidiOut midiout(rtmidiout);
+        if (opt_voicing_cache && voicingcache.is_modified() && !voicingcache.save(voicing_cache_filename))
+            std::cerr << "Warning: could not write voicing cache " << voicing_cache_filename << std::endl;
 
-            seq=new Sequencer(midiout, opt_bpm, opt_transpose_by);
+        print_stats();
 
-            for (int i=0;i<ensemble.get_harmony_voice_count();i++) {
-                const auto& voice=ensemble.get_harmony_voice(i);
+        poptFreeContext(pctx);
 
-                auto* track=seq->add_track(voice.midi_channel, voice.midi_program);
+        return result;
+    }
 
-                for (int j=0;j<bars.size();j++) {
-                    track->append_note(4.0f*j, bars[j].voicing[i], voice.midi_velocity);
+    std::vector<VoiceLeading> alternatives;
 
-                    if (opt_embellish && voice.role==Ensemble::Voice::Role::Harmony && (opt_loop || j+1<bars.size())) {
-                        const int cur =bars[j].scale.to_scale(bars[j                        ].voicing[i]);
-                        const int next=bars[j].scale.to_scale(bars[j+1<bars.size() ? j+1 : 0].voicing[i]);
+    if (opt_beam_width>0 || opt_best>1) {
+        const int count=std::max(opt_best, 1);
+        const int width=std::max(opt_beam_width>0 ? opt_beam_width : 256, count);
 
-                        if (cur+1<next)
-                            track->append_note(4.0f*j+3.0f, bars[j].scale(next-1), voice.midi_velocity);
-                        if (cur-1>next)
-                            track->append_note(4.0f*j+3.0f, bars[j].scale(next+1), voice.midi_velocity);
-                    }
-                }
+        alternatives=compute_voice_leading_beam(voicingcache, threadpool, bars, options.loop, width, count);
 
-                track->append_pause(bars.size()*4.0f);
-            }
+        if (opt_compare_exact) {
+            std::vector<Bar> exactbars(bars.size());
+            for (int i=0;i<bars.size();i++)
+                exactbars[i].chord=bars[i].chord;
 
-            if (opt_rhythm) {
-                for (int i=0;i<rhythm.get_voice_count();i++) {
-                    const auto& voice=rhythm.get_voice(i);
-
-                    auto* track=seq->add_track(voice.midi_channel, voice.midi_program);
-
-                    for (int j=0;j<bars.size();j++) {
-                        const auto& pattern=(!opt_loop || j+1<bars.size() || voice.loop_end_pattern.empty()) ? voice.pattern : voice.loop_end_pattern;
-
-                        const int m=pattern.length();
-
-                        if (voice.role==Rhythm::Voice::Role::Percussion) {
-                            for (int k=0;k<m;k++) {
-                                switch (pattern[k]) {
-                                case 'X':
-                                    track->append_note(4.0f*j + 4.0f*k/m, voice.midi_note, voice.midi_velocity_strong);
-                                    break;
-                                case 'x':
-                                    track->append_note(4.0f*j + 4.0f*k/m, voice.midi_note, voice.midi_velocity_weak);
-                                    break;
-                                case '.':
-                                    track->append_pause(4.0f*j + 4.0f*k/m);
-                                    break;
-                                }
-                            }
-                        }
-                        else {  // bass
-                            const Note bassnote=bars[j].voicing[0];
-
-                            for (int k=0;k<m;k++) {
-                                switch (pattern[k]) {
-                                case 'X':
-                                    track->append_note(4.0f*j + 4.0f*k/m, bassnote, voice.midi_velocity_strong);
-                                    break;
-                                case 'x':
-                                    track->append_note(4.0f*j + 4.0f*k/m, bassnote, voice.midi_velocity_weak);
-                                    break;
-                                case '.':
-                                    track->append_pause(4.0f*j + 4.0f*k/m);
-                                    break;
-                                }
-                            }
-                        }
-                    }
-
-                    track->append_pause(bars.size()*4.0f);
-                }
-            }
+            const int exactcost=compute_voice_leading(voicingcache, threadpool, exactbars, options.loop);
+            const int beamcost=alternatives[0].cost;
+
+            fprintf(stderr, "Beam search cost %d, exact cost %d, gap %d (%.2f%%)\n", beamcost, exactcost, beamcost-exactcost, exactcost>0 ? 100.0*(beamcost-exactcost)/exactcost : 0.0);
+        }
+
+        for (int i=0;i<bars.size();i++)
+            bars[i].voicing=std::move(alternatives[0].voicings[i]);
+    }
+    else
+        compute_voice_leading(voicingcache, threadpool, bars, options.loop);
+
+    if (opt_voicing_cache && voicingcache.is_modified() && !voicingcache.save(voicing_cache_filename))
+        std::cerr << "Warning: could not write voicing cache " << voicing_cache_filename << std::endl;
+
+    compute_scales_for_chords(bars);
+
+    if (opt_best>1) {
+        for (int l=0;l<alternatives.size();l++) {
+            std::cout << "Voice leading " << l+1 << " (cost " << alternatives[l].cost << ")" << std::endl;
+
+            for (int i=0;i<bars.size();i++)
+                ensemble.print_harmony_voicing(bars[i].chord, bars[i].scale, l ? alternatives[l].voicings[i] : bars[i].voicing);
+        }
+    }
+    else
+        for (int i=0;i<bars.size();i++)
+            ensemble.print_harmony_voicing(bars[i].chord, bars[i].scale, bars[i].voicing);
+    
+    if (opt_play || opt_output) {
+        if (opt_play)
+            signal(SIGINT, break_handler);
+
+        try {
+            // without -p, the tracks are only rendered to the file and no MIDI port is needed
+            std::unique_ptr<RtMidiOut> rtmidiout;
+            std::unique_ptr<MidiSink> sink=opt_play ? open_midi_sink(rtmidiout) : std::unique_ptr<MidiSink>(new NullMidiSink());
+            if (!sink)
+                return 1;
 
-            if (opt_improvise && ensemble.get_melody_voice_count()>0) {
-                std::vector<Note> melody=improvise_melody(bars, ensemble.get_melody_voice(0));
-                melody=improvise_passing_notes(melody, bars);
+            MidiOut midiout(*sink);
 
-                const auto& melody_voice=ensemble.get_melody_voice(0);
-                auto* melody_track=seq->add_track(melody_voice.midi_channel, melody_voice.midi_program);
+            const int ppq=compute_ticks_per_beat(rhythm);
 
-                const float melody_timing[4]={ 0.0f, 1.5f, 2.0f, 3.5f };
-                for (int i=0;i<melody.size();i++)
-                    melody_track->append_note((i&~3)*1.0f + melody_timing[i&3], melody[i], melody_voice.midi_velocity);
-                
-                melody_track->append_pause(melody.size()*1.0f);
+            SequencerPtr sequencer=start_sequencer(midiout, ppq);
+
+            render_progression(*sequencer, ensemble, rhythm, bars, options);
+
+            if (opt_output && !sequencer->write_smf(opt_output)) {
+                std::cerr << "Error: could not write MIDI file " << opt_output << std::endl;
+                return 1;
             }
 
-            ensemble.init_midi_programs(midiout);
+            if (opt_play) {
+                ensemble.init_midi_programs(*sequencer);
+
+                sequencer->play(options.loop);
 
-            seq->play(opt_loop);
+                print_lateness_stats(*sequencer);
+                close_midi_sink(*sink);
+            }
         }
         catch (const RtMidiError& err) {
             err.printMessage();
         }
     }
 
+    print_stats();
+
     poptFreeContext(pctx);
 
     return 0;
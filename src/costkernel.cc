@@ -0,0 +1,253 @@
+#include <atomic>
+#include <vector>
+#include "costkernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+
+struct CostKernelImpl {
+    const char* name;
+    void (*compute)(const VoicingCostKernel&, int, int, int*);
+    bool (*supported)();
+
+    static void compute_scalar(const VoicingCostKernel&, int begin, int end, int* costs);
+    static void compute_oversized(const VoicingCostKernel&, int begin, int end, int* costs);
+#ifdef HAVE_X86_KERNELS
+    static void compute_sse41(const VoicingCostKernel&, int begin, int end, int* costs);
+    static void compute_avx2(const VoicingCostKernel&, int begin, int end, int* costs);
+#endif
+};
+
+
+VoicingCostKernel::VoicingCostKernel(const Ensemble::VoicingView& fixed, const uint8_t* const* others):fixed(fixed), manyothers(others)
+{
+    numvoices=fixed.get_voice_count();
+    numintervals=0;
+
+    if (numvoices>max_voices)
+        return;
+
+    for (int i=0;i<numvoices;i++) {
+        pitches[i]=fixed[i].get_midi_note();
+        this->others[i]=others[i];
+    }
+
+    for (int i=1;i<numvoices;i++) {
+        for (int j=0;j<i;j++) {
+            int v=pitches[i] - pitches[j];
+            if (v%12!=0 && v%12!=7) continue;
+
+            intervals[numintervals++]=Interval { i, j, v };
+        }
+    }
+}
+
+
+void CostKernelImpl::compute_scalar(const VoicingCostKernel& in, int begin, int end, int* costs)
+{
+    for (int k=begin;k<end;k++) {
+        int cost=0;
+
+        for (int i=0;i<in.numvoices;i++) {
+            int v=in.pitches[i] - in.others[i][k];
+            cost+=v*v;
+        }
+
+        for (int m=0;m<in.numintervals;m++) {
+            const auto& iv=in.intervals[m];
+            if (in.others[iv.upper][k]==in.others[iv.lower][k]+iv.semitones)
+                cost+=1000; // forbidden parallel
+        }
+
+        costs[k]=cost;
+    }
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+__attribute__((target("sse4.1")))
+static inline __m128i load_pitches_sse(const uint8_t* p)
+{
+    int32_t tmp;
+    __builtin_memcpy(&tmp, p, sizeof(tmp));
+    return _mm_cvtepu8_epi32(_mm_cvtsi32_si128(tmp));
+}
+
+
+__attribute__((target("sse4.1")))
+void CostKernelImpl::compute_sse41(const VoicingCostKernel& in, int begin, int end, int* costs)
+{
+    const __m128i penalty=_mm_set1_epi32(1000);
+
+    int k=begin;
+    for (;k+4<=end;k+=4) {
+        __m128i cost=_mm_setzero_si128();
+
+        for (int i=0;i<in.numvoices;i++) {
+            __m128i v=_mm_sub_epi32(_mm_set1_epi32(in.pitches[i]), load_pitches_sse(in.others[i]+k));
+            cost=_mm_add_epi32(cost, _mm_mullo_epi32(v, v));
+        }
+
+        for (int m=0;m<in.numintervals;m++) {
+            const auto& iv=in.intervals[m];
+
+            __m128i upper=load_pitches_sse(in.others[iv.upper]+k);
+            __m128i lower=_mm_add_epi32(load_pitches_sse(in.others[iv.lower]+k), _mm_set1_epi32(iv.semitones));
+            cost=_mm_add_epi32(cost, _mm_and_si128(_mm_cmpeq_epi32(upper, lower), penalty));
+        }
+
+        _mm_storeu_si128((__m128i*) (costs+k), cost);
+    }
+
+    compute_scalar(in, k, end, costs);
+}
+
+
+__attribute__((target("avx2")))
+static inline __m256i load_pitches_avx2(const uint8_t* p)
+{
+    return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) p));
+}
+
+
+__attribute__((target("avx2")))
+void CostKernelImpl::compute_avx2(const VoicingCostKernel& in, int begin, int end, int* costs)
+{
+    const __m256i penalty=_mm256_set1_epi32(1000);
+
+    int k=begin;
+    for (;k+8<=end;k+=8) {
+        __m256i cost=_mm256_setzero_si256();
+
+        for (int i=0;i<in.numvoices;i++) {
+            __m256i v=_mm256_sub_epi32(_mm256_set1_epi32(in.pitches[i]), load_pitches_avx2(in.others[i]+k));
+            cost=_mm256_add_epi32(cost, _mm256_mullo_epi32(v, v));
+        }
+
+        for (int m=0;m<in.numintervals;m++) {
+            const auto& iv=in.intervals[m];
+
+            __m256i upper=load_pitches_avx2(in.others[iv.upper]+k);
+            __m256i lower=_mm256_add_epi32(load_pitches_avx2(in.others[iv.lower]+k), _mm256_set1_epi32(iv.semitones));
+            cost=_mm256_add_epi32(cost, _mm256_and_si256(_mm256_cmpeq_epi32(upper, lower), penalty));
+        }
+
+        _mm256_storeu_si256((__m256i*) (costs+k), cost);
+    }
+
+    compute_scalar(in, k, end, costs);
+}
+
+#endif
+
+
+// ensembles with more voices than the kernels are laid out for take the slow path
+void CostKernelImpl::compute_oversized(const VoicingCostKernel& in, int begin, int end, int* costs)
+{
+    const Ensemble::VoicingView& fixed=in.fixed;
+    const int n=fixed.get_voice_count();
+
+    std::vector<int> pitches(n);
+
+    for (int k=begin;k<end;k++) {
+        for (int i=0;i<n;i++)
+            pitches[i]=in.manyothers[i][k];
+
+        int cost=0;
+
+        for (int i=0;i<n;i++) {
+            int v=fixed[i].get_midi_note() - pitches[i];
+            cost+=v*v;
+        }
+
+        for (int i=1;i<n;i++) {
+            for (int j=0;j<i;j++) {
+                int v=fixed[i].get_midi_note() - fixed[j].get_midi_note();
+                if (v%12!=0 && v%12!=7) continue;
+
+                if (pitches[i]==pitches[j]+v)
+                    cost+=1000; // forbidden parallel
+            }
+        }
+
+        costs[k]=cost;
+    }
+}
+
+
+const static CostKernelImpl cost_kernels[]={
+#ifdef HAVE_X86_KERNELS
+    { "avx2",   CostKernelImpl::compute_avx2,   []() { return bool(__builtin_cpu_supports("avx2")); } },
+    { "sse4.1", CostKernelImpl::compute_sse41,  []() { return bool(__builtin_cpu_supports("sse4.1")); } },
+#endif
+    { "scalar", CostKernelImpl::compute_scalar, []() { return true; } }
+};
+
+static const CostKernelImpl* detect_cost_kernel()
+{
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+#endif
+
+    const CostKernelImpl* kernel=cost_kernels;
+    while (!kernel->supported())
+        kernel++;
+
+    return kernel;
+}
+
+// may be changed by select_cost_kernel while other threads compute costs; the kernels
+// themselves are constant, so relaxed accesses suffice
+static std::atomic<const CostKernelImpl*> cost_kernel { detect_cost_kernel() };
+
+
+void VoicingCostKernel::operator()(int begin, int end, int* costs) const
+{
+    if (numvoices>max_voices)
+        CostKernelImpl::compute_oversized(*this, begin, end, costs);
+    else
+        cost_kernel.load(std::memory_order_relaxed)->compute(*this, begin, end, costs);
+}
+
+
+void compute_voice_leading_costs(const Ensemble::VoicingView& from, const Ensemble::VoicingTable& to, int begin, int end, int* costs)
+{
+    const int n=to.get_voice_count();
+
+    const uint8_t* pitches[VoicingCostKernel::max_voices];
+    std::vector<const uint8_t*> manypitches;
+
+    const uint8_t** others=pitches;
+    if (n>VoicingCostKernel::max_voices) {
+        manypitches.resize(n);
+        others=manypitches.data();
+    }
+
+    for (int i=0;i<n;i++)
+        others[i]=to.get_pitches(i);
+
+    VoicingCostKernel(from, others)(begin, end, costs);
+}
+
+
+const char* get_cost_kernel_name()
+{
+    return cost_kernel.load(std::memory_order_relaxed)->name;
+}
+
+
+bool select_cost_kernel(const std::string& name)
+{
+    for (const CostKernelImpl& kernel: cost_kernels) {
+        if (name==kernel.name && kernel.supported()) {
+            cost_kernel.store(&kernel, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
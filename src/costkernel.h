@@ -0,0 +1,53 @@
+#ifndef INCLUDE_COSTKERNEL_H
+#define INCLUDE_COSTKERNEL_H
+
+#include <string>
+#include "ensemble.h"
+
+
+// Scores one fixed voicing against many others given as one pitch array per voice (as
+// returned by VoicingTable::get_pitches), i.e. costs[k]=compute_voice_leading_cost(fixed, other k)
+// for k in [begin, end).  The cost is symmetric, so the fixed voicing may be either end of the
+// transition.  The array of pitch arrays has to outlive the kernel.
+// A vectorized implementation is picked at runtime if the CPU supports one.
+class VoicingCostKernel {
+    friend struct CostKernelImpl;
+
+public:
+    const static int max_voices=32;
+
+    VoicingCostKernel(const Ensemble::VoicingView& fixed, const uint8_t* const* others);
+
+    void operator()(int begin, int end, int* costs) const;
+
+private:
+    struct Interval {
+        int upper;
+        int lower;
+        int semitones;
+    };
+
+    Ensemble::VoicingView   fixed;
+
+    int             numvoices;
+    int             pitches[max_voices];
+
+    // perfect intervals of the fixed voicing; moving such a voice pair in parallel is penalized
+    int             numintervals;
+    Interval        intervals[max_voices*(max_voices-1)/2];
+
+    const uint8_t*  others[max_voices];
+    const uint8_t* const* manyothers;
+};
+
+
+// costs[j]=compute_voice_leading_cost(from, to[j]) for j in [begin, end)
+void compute_voice_leading_costs(const Ensemble::VoicingView& from, const Ensemble::VoicingTable& to, int begin, int end, int* costs);
+
+const char* get_cost_kernel_name();
+
+// Overrides the automatic choice, e.g. for benchmarking, also while other threads compute costs;
+// fails if the CPU does not support the kernel
+bool select_cost_kernel(const std::string& name);
+
+#endif
@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <iterator>
+#include "definitionparser.h"
+
+
+std::ostream& operator<<(std::ostream& ostr, const ParseDiagnostic& diag)
+{
+    return ostr << "line " << diag.line << ", column " << diag.column << ": " << diag.message;
+}
+
+
+static bool is_space(char c)
+{
+    return c==' ' || c=='\t' || c=='\r' || c=='\v' || c=='\f';
+}
+
+
+bool DefinitionScanner::next_line()
+{
+    while (nextline<text.size()) {
+        linestart=nextline;
+
+        size_t end=text.find('\n', linestart);
+        if (end==std::string_view::npos)
+            end=text.size();
+
+        nextline=end+1;
+        line++;
+
+        const size_t comment=text.substr(linestart, end-linestart).find(';');
+        lineend=comment==std::string_view::npos ? end : linestart+comment;
+
+        pos=linestart;
+        while (pos<lineend && is_space(text[pos]))
+            pos++;
+
+        if (pos<lineend)
+            return true;
+    }
+
+    return false;
+}
+
+
+std::string_view DefinitionScanner::next_field()
+{
+    while (pos<lineend && is_space(text[pos]))
+        pos++;
+
+    const size_t start=pos;
+    while (pos<lineend && !is_space(text[pos]))
+        pos++;
+
+    return text.substr(start, pos-start);
+}
+
+
+void DefinitionScanner::error(std::string_view field, const std::string& message)
+{
+    const int column=field.data()-text.data()-linestart+1;
+    diagnostics.push_back(ParseDiagnostic { line, column, message });
+}
+
+
+bool DefinitionScanner::expect_end_of_line()
+{
+    const std::string_view field=next_field();
+    if (field.empty())
+        return true;
+
+    error(field, "unexpected '" + std::string(field) + "'");
+    return false;
+}
+
+
+bool DefinitionScanner::parse_int(std::string_view field, const char* what, int min, int max, int& value)
+{
+    if (field.empty()) {
+        error(field, std::string("missing ") + what);
+        return false;
+    }
+
+    value=0;
+    for (char c: field) {
+        if (c<'0' || c>'9') {
+            error(field, std::string("invalid ") + what + " '" + std::string(field) + "'");
+            return false;
+        }
+
+        // saturates, as anything this large is out of range anyway
+        value=std::min(value*10 + (c-'0'), max+1);
+    }
+
+    if (value<min || value>max) {
+        error(field, std::string(what) + " must be between " + std::to_string(min) + " and " + std::to_string(max));
+        return false;
+    }
+
+    return true;
+}
+
+
+bool DefinitionScanner::parse_note(std::string_view field, const char* what, Note& note)
+{
+    const char* p=field.data();
+    const char* end=p+field.size();
+
+    NoteClass nc;
+    if (!parse_note_class(p, end, nc) || end-p!=1 || *p<'0' || *p>'9') {
+        error(field, std::string("invalid ") + what + " '" + std::string(field) + "'");
+        return false;
+    }
+
+    note=Note(nc, *p-'0');
+    return true;
+}
+
+
+std::string read_definition(std::istream& istr)
+{
+    return std::string(std::istreambuf_iterator<char>(istr), std::istreambuf_iterator<char>());
+}
@@ -0,0 +1,58 @@
+#ifndef INCLUDE_DEFINITIONPARSER_H
+#define INCLUDE_DEFINITIONPARSER_H
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "note.h"
+
+
+// a problem found in a definition file, with its position counted from 1
+struct ParseDiagnostic {
+    int         line;
+    int         column;
+    std::string message;
+};
+
+std::ostream& operator<<(std::ostream&, const ParseDiagnostic&);
+
+
+// Splits the text of an ensemble or rhythm definition into lines of fields separated by
+// whitespace, where a semicolon starts a comment up to the end of the line.  Fields are views
+// into the text, so that scanning allocates nothing, and problems are collected as diagnostics
+// instead of stopping at the first one.
+class DefinitionScanner {
+public:
+    DefinitionScanner(std::string_view text, std::vector<ParseDiagnostic>& diagnostics):text(text), diagnostics(diagnostics) {}
+
+    // advances to the next line which has any fields; false at the end of the text
+    bool next_line();
+
+    // the next field on the current line, or an empty view after the last one
+    std::string_view next_field();
+
+    // reports a diagnostic at the given field and the fields left on the line, if any
+    void error(std::string_view field, const std::string& message);
+    bool expect_end_of_line();
+
+    // these report a diagnostic about the field named what if it is invalid
+    bool parse_int(std::string_view field, const char* what, int min, int max, int& value);
+    bool parse_note(std::string_view field, const char* what, Note& note);
+
+private:
+    std::string_view    text;
+    size_t              pos=0;
+    size_t              linestart=0;
+    size_t              lineend=0;      // before the comment, if any
+    size_t              nextline=0;
+    int                 line=0;
+
+    std::vector<ParseDiagnostic>&   diagnostics;
+};
+
+
+// reads all of a definition file, so that it can be scanned in one piece
+std::string read_definition(std::istream&);
+
+#endif
@@ -3,6 +3,7 @@
 #include "chord.h"
 #include "scale.h"
 #include "midi.h"
+#include "stats.h"
 
 
 Ensemble::Voicing::Voicing(int numvoices):numvoices(numvoices)
@@ -11,6 +12,15 @@ Ensemble::Voicing::Voicing(int numvoices):numvoices(numvoices)
 }
 
 
+Ensemble::Voicing::Voicing(const VoicingView& view):numvoices(view.get_voice_count())
+{
+    notes=new Note[numvoices];
+
+    for (int i=0;i<numvoices;i++)
+        notes[i]=view[i];
+}
+
+
 Ensemble::Voicing::Voicing(Voicing&& other)
 {
     numvoices=other.numvoices;
@@ -54,27 +64,102 @@ void Ensemble::add_voice(const Voice& v)
 }
 
 
-void Ensemble::init_midi_programs(MidiOut& midi) const
+void Ensemble::init_midi_programs(Sequencer& seq) const
 {
     for (const Voice& v: harmony_voices)
-        midi.program_change(v.midi_channel, v.midi_program);
+        seq.program_change(v.midi_channel, v.midi_program);
 
     for (const Voice& v: melody_voices)
-        midi.program_change(v.midi_channel, v.midi_program);
+        seq.program_change(v.midi_channel, v.midi_program);
+}
+
+
+uint64_t Ensemble::get_fingerprint() const
+{
+    // covers everything enumerate_harmony_voicings depends on
+    uint64_t hash=14695981039346656037ull;
+    auto add=[&hash](int v) { hash=(hash ^ uint8_t(v)) * 1099511628211ull; };
+
+    add(harmony_voices.size());
+
+    for (const Voice& v: harmony_voices) {
+        add(int(v.role));
+        add(v.range_low.get_midi_note());
+        add(v.range_high.get_midi_note());
+    }
+
+    return hash;
 }
 
 
-std::vector<Ensemble::Voicing> Ensemble::enumerate_harmony_voicings(const Chord& chord) const
+struct VoicingSearch {
+    const Chord&        chord;
+    const int           numvoices;
+
+    std::vector<Note>*  noteset;
+    std::vector<uint8_t>* tonemask;     // chord tones matched by each candidate note
+    uint8_t*            reachable;      // chord tones available to voices 0..i
+    Note*               lowest;         // lowest note of voice i admitting an ascending voicing below it
+
+    Note*               current;
+
+    Ensemble::VoicingTable& result;
+    int64_t             rejected=0;     // partial voicings which could not be completed
+
+    void search(int i, uint8_t havenotes);
+};
+
+
+void VoicingSearch::search(int i, uint8_t havenotes)
 {
-    std::vector<Voicing> result;
+    // remaining voices 0..i have to supply all required tones still missing
+    const uint8_t missing=chord.required & ~havenotes;
+    if (missing & ~reachable[i]) {
+        rejected++;
+        return;
+    }
+
+    int nmissing=0;
+    for (uint8_t m=missing;m;m&=m-1)
+        nmissing++;
+
+    if (nmissing>i+1) {
+        rejected++;
+        return;
+    }
+
+    for (int k=0;k<noteset[i].size();k++) {
+        const Note& note=noteset[i][k];
+
+        // voices must not cross
+        if (note<lowest[i] || (i+1<numvoices && note>=current[i+1])) {
+            rejected++;
+            continue;
+        }
+
+        current[i]=note;
+
+        if (i>0)
+            search(i-1, havenotes | tonemask[i][k]);
+        else if (!(chord.required & ~(havenotes | tonemask[i][k])))
+            result.append(current);
+        else
+            rejected++;
+    }
+}
+
+
+Ensemble::VoicingTable Ensemble::enumerate_harmony_voicings(const Chord& chord) const
+{
+    Stats::ScopedTimer timer(Stats::Timer::Enumerate);
 
     const int n=harmony_voices.size();
 
+    VoicingTable result(n);
+    if (!n) return result;
+
     std::vector<Note>* noteset=new std::vector<Note>[n];
-    
-    int* seq=new int[n];
-    for (int i=0;i<n;i++)
-        seq[i]=0;
+    std::vector<uint8_t>* tonemask=new std::vector<uint8_t>[n];
 
     for (int i=0;i<n;i++) {
         if (harmony_voices[i].role==Voice::Role::Bass) {
@@ -101,47 +186,62 @@ std::vector<Ensemble::Voicing> Ensemble::enumerate_harmony_voicings(const Chord&
                 }
             }
         }
-    }
-
-    for (;;) {
-        Voicing voicing(n);
-        uint8_t havenotes=0;
-
-        for (int i=0;i<n;i++) {
-            voicing[i]=noteset[i][seq[i]];
 
+        for (const Note& note: noteset[i]) {
+            uint8_t mask=0;
             for (int j=0;j<6;j++)
-                if (chord.notes[j]==voicing[i])
-                    havenotes|=1<<j;
+                if (chord.notes[j]==note)
+                    mask|=1<<j;
+
+            tonemask[i].push_back(mask);
         }
+    }
+
+    uint8_t* reachable=new uint8_t[n];
+    Note* lowest=new Note[n];
+    Note* current=new Note[n];
 
-        bool monotonic=true;
-        for (int i=1;i<n;i++)
-            if (voicing[i-1]>=voicing[i])
-                monotonic=false;
+    bool feasible=true;
 
-        if (monotonic && !(chord.required&~havenotes))
-            result.push_back(std::move(voicing));
+    for (int i=0;i<n;i++) {
+        reachable[i]=i>0 ? reachable[i-1] : 0;
+        for (uint8_t mask: tonemask[i])
+            reachable[i]|=mask;
 
-        int i=0;
-        while (i<n) {
-            if (++seq[i]<noteset[i].size())
-                break;
+        bool found=false;
+        for (const Note& note: noteset[i]) {
+            if (i>0 && note<=lowest[i-1]) continue;
 
-            seq[i++]=0;
+            if (!found || note<lowest[i]) {
+                lowest[i]=note;
+                found=true;
+            }
         }
 
-        if (i==n) break;
+        if (!found)
+            feasible=false;
     }
 
+    if (feasible) {
+        VoicingSearch search { chord, n, noteset, tonemask, reachable, lowest, current, result };
+        search.search(n-1, 0);
+
+        Stats::add(Stats::Counter::VoicingsRejected, search.rejected);
+    }
+
+    Stats::add(Stats::Counter::VoicingsEnumerated, result.size());
+
     delete[] noteset;
-    delete[] seq;
+    delete[] tonemask;
+    delete[] reachable;
+    delete[] lowest;
+    delete[] current;
 
     return result;
 }
 
 
-void Ensemble::print_harmony_voicing(const Chord& chord, const Scale& scale, const Voicing& voicing) const
+void Ensemble::print_harmony_voicing(const Chord& chord, const Scale& scale, const VoicingView& voicing) const
 {
     const char* colorcodes[8]={
         "\e[90m",
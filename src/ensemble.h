@@ -6,7 +6,7 @@
 
 class Chord;
 class Scale;
-class MidiOut;
+class Sequencer;
 
 
 class Ensemble {
@@ -29,6 +29,25 @@ public:
     };
 
 
+    class VoicingView {
+        const Note* notes;
+        int         numvoices;
+
+    public:
+        VoicingView(const Note* notes, int numvoices):notes(notes), numvoices(numvoices) {}
+
+        int get_voice_count() const
+        {
+            return numvoices;
+        }
+
+        const Note& operator[](int i) const
+        {
+            return notes[i];
+        }
+    };
+
+
     class Voicing {
         int     numvoices;
         Note*   notes;
@@ -41,6 +60,7 @@ public:
         }
         
         explicit Voicing(int numvoices);
+        explicit Voicing(const VoicingView&);
         Voicing(const Voicing&) = delete;
         Voicing(Voicing&&);
         ~Voicing();
@@ -62,6 +82,68 @@ public:
         {
             return notes[i];
         }
+
+        operator VoicingView() const
+        {
+            return VoicingView(notes, numvoices);
+        }
+    };
+
+
+    // all voicings of a chord, stored back to back in a single buffer
+    class VoicingTable {
+        int                 numvoices;
+        int                 numvoicings=0;
+        std::vector<Note>   notes;
+
+        // the same voicings as MIDI note numbers, one contiguous array per voice
+        std::vector<std::vector<uint8_t>>   pitches;
+
+    public:
+        explicit VoicingTable(int numvoices):numvoices(numvoices), pitches(numvoices) {}
+
+        int get_voice_count() const
+        {
+            return numvoices;
+        }
+
+        int size() const
+        {
+            return numvoicings;
+        }
+
+        bool empty() const
+        {
+            return !numvoicings;
+        }
+
+        void reserve(int n)
+        {
+            notes.reserve(n*numvoices);
+
+            for (auto& p: pitches)
+                p.reserve(n);
+        }
+
+        void append(const Note* voicing)
+        {
+            notes.insert(notes.end(), voicing, voicing+numvoices);
+
+            for (int i=0;i<numvoices;i++)
+                pitches[i].push_back(voicing[i].get_midi_note());
+
+            numvoicings++;
+        }
+
+        VoicingView operator[](int i) const
+        {
+            return VoicingView(notes.data() + i*numvoices, numvoices);
+        }
+
+        const uint8_t* get_pitches(int voice) const
+        {
+            return pitches[voice].data();
+        }
     };
 
 
@@ -87,11 +169,13 @@ public:
         return melody_voices.size();
     }
 
-    void init_midi_programs(MidiOut&) const;
+    void init_midi_programs(Sequencer&) const;
+
+    uint64_t get_fingerprint() const;
 
-    std::vector<Voicing> enumerate_harmony_voicings(const Chord&) const;
+    VoicingTable enumerate_harmony_voicings(const Chord&) const;
 
-    void print_harmony_voicing(const Chord&, const Scale&, const Voicing&) const;
+    void print_harmony_voicing(const Chord&, const Scale&, const VoicingView&) const;
 
 private:
     std::vector<Voice>  harmony_voices;
@@ -1,81 +1,74 @@
-#include <stdlib.h>
-#include <regex>
 #include "ensembleparser.h"
 
 
-struct EnsembleParser::Internal {
-    std::regex regex {
-        "[[:space:]]*"
-        "([[:lower:]]+)"    // role
-        "[[:space:]]+"
-        "([[:digit:]]+)"    // MIDI channel
-        "[[:space:]]+"
-        "([[:digit:]]+)"    // MIDI program (instrument)
-        "[[:space:]]+"
-        "([[:digit:]]+)"    // MIDI velocity
-        "[[:space:]]+"
-        "([A-G][#b]?[0-9])" // low end
-        "\\.\\.\\."
-        "([A-G][#b]?[0-9])" // high end
-        "[[:space:]]+"
-        "([0-7])"           // color
-        "[[:space:]]*"
-        "(?:;.*)"           // comment
-    };
-};
-
-
-EnsembleParser::EnsembleParser()
-{
-    internal=new Internal;
-}
-
-
-EnsembleParser::~EnsembleParser()
+/*
+ * Each line of an ensemble definition describes one voice:
+ *
+ *   role  MIDI-channel  MIDI-program  MIDI-velocity  low...high  color  ; comment
+ *
+ * with role one of bass, harmony or melody, the range given by notes like A2 and E4, and the
+ * color from 0 to 7.
+ */
+bool EnsembleParser::parse_voice(DefinitionScanner& scanner, Ensemble::Voice& voice) const
 {
-    delete internal;
-}
-
-
-Ensemble::Voice EnsembleParser::parse_voice(const std::string& line) const
-{
-    Ensemble::Voice voice;
-
-    std::smatch result;
-    if (!std::regex_match(line, result, internal->regex)) {
-        std::cerr << "Error parsing ensemble definition: Invalid voice definition\n" << line << std::endl;
-        exit(1);
-    }
+    bool valid=true;
 
-    if (result[1]=="bass")
+    const std::string_view role=scanner.next_field();
+    if (role=="bass")
         voice.role=Ensemble::Voice::Role::Bass;
-    else if (result[1]=="harmony")
+    else if (role=="harmony")
         voice.role=Ensemble::Voice::Role::Harmony;
-    else if (result[1]=="melody")
+    else if (role=="melody")
         voice.role=Ensemble::Voice::Role::Melody;
     else {
-        std::cerr << "Error parsing ensemble definition: Invalid voice role " << result[1] << std::endl;
-        exit(1);
+        scanner.error(role, "invalid voice role '" + std::string(role) + "'");
+        valid=false;
     }
-    
-    voice.midi_channel=stoi(result[2]);
-    voice.midi_program=stoi(result[3]);
-    voice.midi_velocity=stoi(result[4]);
-    voice.range_low=Note(result[5]);
-    voice.range_high=Note(result[6]);
-    voice.color=stoi(result[7]);
 
-    return voice;
+    int channel=0, program=0, velocity=0, color=0;
+    valid&=scanner.parse_int(scanner.next_field(), "MIDI channel", 0, 15, channel);
+    valid&=scanner.parse_int(scanner.next_field(), "MIDI program", 0, 127, program);
+    valid&=scanner.parse_int(scanner.next_field(), "MIDI velocity", 0, 127, velocity);
+
+    const std::string_view range=scanner.next_field();
+    const size_t dots=range.find("...");
+    if (dots!=std::string_view::npos) {
+        valid&=scanner.parse_note(range.substr(0, dots), "low end of range", voice.range_low);
+        valid&=scanner.parse_note(range.substr(dots+3), "high end of range", voice.range_high);
+    }
+    else {
+        scanner.error(range, range.empty() ? "missing range" : "invalid range '" + std::string(range) + "'");
+        valid=false;
+    }
+
+    valid&=scanner.parse_int(scanner.next_field(), "color", 0, 7, color);
+    valid&=scanner.expect_end_of_line();
+
+    voice.midi_channel=channel;
+    voice.midi_program=program;
+    voice.midi_velocity=velocity;
+    voice.color=color;
+
+    return valid;
 }
 
 
-Ensemble EnsembleParser::operator()(std::istream& istr) const
+Ensemble EnsembleParser::operator()(std::string_view text, std::vector<ParseDiagnostic>& diagnostics) const
 {
     Ensemble ensemble;
+    DefinitionScanner scanner(text, diagnostics);
 
-    std::string line;
-    while (getline(istr, line))
-        ensemble.add_voice(parse_voice(line));
+    while (scanner.next_line()) {
+        Ensemble::Voice voice;
+        if (parse_voice(scanner, voice))
+            ensemble.add_voice(voice);
+    }
 
     return ensemble;
 }
+
+
+Ensemble EnsembleParser::operator()(std::istream& istr, std::vector<ParseDiagnostic>& diagnostics) const
+{
+    return (*this)(read_definition(istr), diagnostics);
+}
@@ -2,20 +2,19 @@
 #define INCLUDE_ENSEMBLEPARSER_H
 
 #include <iostream>
+#include <string_view>
+#include <vector>
 #include "ensemble.h"
+#include "definitionparser.h"
 
 class EnsembleParser {
-    struct Internal;
-
-    Internal*   internal;
-
-    Ensemble::Voice parse_voice(const std::string&) const;
+    bool parse_voice(DefinitionScanner&, Ensemble::Voice&) const;
 
 public:
-    EnsembleParser();
-    ~EnsembleParser();
-
-    Ensemble operator()(std::istream&) const;
+    // Invalid lines are skipped and reported in the diagnostics, so the ensemble is only
+    // complete if there are none.
+    Ensemble operator()(std::string_view text, std::vector<ParseDiagnostic>&) const;
+    Ensemble operator()(std::istream&, std::vector<ParseDiagnostic>&) const;
 };
 
 #endif
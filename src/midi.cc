@@ -1,106 +1,501 @@
+#include <algorithm>
+#include <fstream>
 #include <queue>
-#include <unistd.h>
-#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
 #include "midi.h"
 #include "note.h"
+#include "smf.h"
+#include "stats.h"
 
 
-Sequencer::Track::Track(int8_t channel, int8_t transposition):channel(channel), transposition(transposition)
+// falling behind the schedule by more than this (e.g. waiting for input) restarts the clock
+const static int64_t resync_ns=100000000;
+
+// how often the output thread checks for new events or an interruption while idle
+const static long output_poll_ns=1000000;
+
+// how often the producer checks for room in the output ring or for the end of playback
+const static long producer_poll_ns=1000000;
+
+
+Sequencer::Track::Track(int8_t channel, int8_t program, int8_t transposition):channel(channel), program(program), transposition(transposition)
 {
 }
 
 
-void Sequencer::Track::append_note(float timestamp, const Note& note, uint8_t vel)
+void Sequencer::Track::append_note(uint32_t tick, const Note& note, uint8_t vel)
 {
-    events.push_back(Event { timestamp, uint8_t(note.get_midi_note()+transposition), vel });
+    events.push_back(Event { tick, uint8_t(note.get_midi_note()+transposition), vel });
 }
 
 
-void Sequencer::Track::append_note(float timestamp, uint8_t note, uint8_t vel)
+void Sequencer::Track::append_note(uint32_t tick, uint8_t note, uint8_t vel)
 {
-    events.push_back(Event { timestamp, uint8_t(note+transposition), vel });
+    events.push_back(Event { tick, uint8_t(note+transposition), vel });
 }
 
 
-void Sequencer::Track::append_pause(float timestamp)
+void Sequencer::Track::append_pause(uint32_t tick)
 {
-    events.push_back(Event { timestamp, 0xff, 0 });
+    events.push_back(Event { tick, 0xff, 0 });
 }
 
 
-Sequencer::Sequencer(MidiOut& midiout, int bpm, int transposition):midiout(midiout), bpm(bpm), transposition(transposition)
+Sequencer::Sequencer(MidiOut& midiout, int bpm, int transposition, int ticks_per_beat):midiout(midiout), transposition(transposition), bpm(bpm), ticks_per_beat(ticks_per_beat)
 {
+    outputthread=std::thread(&Sequencer::output, this);
+}
+
+
+Sequencer::~Sequencer()
+{
+    quit=true;
+    outputthread.join();
+
+    for (Track* track: tracks)
+        delete track;
 }
 
 
 Sequencer::Track* Sequencer::add_track(int8_t channel, int8_t program)
 {
-    midiout.program_change(channel, program);
+    program_change(channel, program);
 
-    Track* track=new Track(channel, channel==9 ? 0 : transposition);
+    Track* track=new Track(channel, program, channel==9 ? 0 : transposition);
     tracks.push_back(track);
 
     return track;
 }
 
 
-void Sequencer::play(bool loop)
+bool Sequencer::program_change(int8_t channel, int8_t program)
 {
-    struct Event {
-        Track*  track;
-        int     index;
-    };
+    return push_output(OutputEvent { get_monotonic_time(), { uint8_t(0xC0|channel), uint8_t(program), 0 }, 2 });
+}
+
+
+bool Sequencer::set_realtime_priority(int priority)
+{
+    sched_param param {};
+    param.sched_priority=priority;
+
+    if (pthread_setschedparam(outputthread.native_handle(), SCHED_FIFO, &param))
+        return false;
+
+    return !mlockall(MCL_CURRENT|MCL_FUTURE);
+}
+
 
-    struct CompareEvent {
-        bool operator()(const Event& lhs, const Event& rhs) const
+int64_t Sequencer::ticks_to_nanoseconds(int64_t ticks) const
+{
+    const int64_t ticksperminute=int64_t(bpm)*ticks_per_beat;
+
+    // whole minutes separately, so that this cannot overflow
+    return ticks/ticksperminute*60000000000LL + ticks%ticksperminute*60000000000LL/ticksperminute;
+}
+
+
+// waits while the ring is full; returns false if interrupted
+bool Sequencer::push_output(const OutputEvent& ev)
+{
+    while (!ring.push(ev)) {
+        if (stopping) return false;
+
+        const timespec ts { 0, producer_poll_ns };
+        nanosleep(&ts, nullptr);
+    }
+
+    scheduled++;
+
+    return !stopping;
+}
+
+
+// Merges all tracks in the order of their events, resolving the note-offs starting from the
+// given notes sounding on each track, which are updated to the notes left sounding at the end.
+// At each tick, the note-offs come before the note-ons, and each in the order of the tracks.
+// Calls emit(track, tick, message) for each message.
+//
+// Tracks on the same channel may sound the same note, so a note is only turned off once no
+// track holds it any more.  A note struck while another track holds it is turned off first,
+// so that every note-on has its note-off.  Tracks which tie notes hold a repeated note
+// instead of striking it again.
+template<typename Emit>
+void Sequencer::merge_tracks(std::vector<int8_t>& notes, Emit emit) const
+{
+    struct Head {
+        uint32_t    tick;
+        int         track;
+        int         index;
+
+        bool operator>(const Head& rhs) const
         {
-            return lhs.track->events[lhs.index].timestamp > rhs.track->events[rhs.index].timestamp;
+            return tick>rhs.tick || (tick==rhs.tick && track>rhs.track);
         }
     };
 
-    std::priority_queue<Event, std::vector<Event>, CompareEvent> queue;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+
+    // number of tracks holding each note on each channel
+    uint8_t holding[16][128]={};
+
+    for (int t=0;t<tracks.size();t++) {
+        if (notes[t]>=0)
+            holding[tracks[t]->channel][notes[t]]++;
+
+        if (!tracks[t]->events.empty())
+            heads.push(Head { tracks[t]->events[0].tick, t, 0 });
+    }
+
+    // the events of all tracks due at the same tick, in the order of the tracks
+    std::vector<Head> batch;
+    std::vector<bool> ties;
 
-    do {
-        for (Track* track: tracks)
-            if (!track->events.empty())
-                queue.push(Event { track, 0 });
-        
-        float curtime=0.0f;
+    while (!heads.empty()) {
+        batch.clear();
+        ties.clear();
 
-        while (!queue.empty()) {
-            Event ev=queue.top();
-            queue.pop();
+        const uint32_t tick=heads.top().tick;
+        while (!heads.empty() && heads.top().tick==tick) {
+            batch.push_back(heads.top());
+            heads.pop();
+        }
+
+        // All notes released at this tick are turned off before any are struck, so that a
+        // note passed from one track to another on the same channel is not struck twice.
+        for (const Head& head: batch) {
+            const Track* track=tracks[head.track];
+            const auto& ev=track->events[head.index];
+            const int ch=track->channel;
 
-            const auto& trev=ev.track->events[ev.index];
+            const bool tie=track->tie_notes && ev.velocity>0 && notes[head.track]==ev.note;
+            ties.push_back(tie);
 
-            if (trev.timestamp>curtime && usleep(lrintf((trev.timestamp-curtime)*60000000.0f/bpm))<0) {
-                for (Track* track: tracks)
-                    if (track->curnote>=0)
-                        midiout.note_off(track->channel, track->curnote, 0);
+            if (!tie && notes[head.track]>=0) {
+                if (!--holding[ch][notes[head.track]]) {
+                    const uint8_t msg[3]={ uint8_t(0x80|ch), uint8_t(notes[head.track]), 0 };
+                    emit(head.track, tick, msg);
+                }
 
-                return;
+                notes[head.track]=-1;
             }
+        }
+
+        for (int b=0;b<batch.size();b++) {
+            const Track* track=tracks[batch[b].track];
+            const auto& ev=track->events[batch[b].index];
+            const int ch=track->channel;
+
+            if (ties[b] || !ev.velocity) continue;
 
-            curtime=trev.timestamp;
+            // another track holds the note already, so end it before striking it again and
+            // keep note-ons and note-offs balanced
+            if (holding[ch][ev.note]) {
+                const uint8_t msg[3]={ uint8_t(0x80|ch), ev.note, 0 };
+                emit(batch[b].track, tick, msg);
+            }
+
+            const uint8_t msg[3]={ uint8_t(0x90|ch), ev.note, ev.velocity };
+            emit(batch[b].track, tick, msg);
+
+            holding[ch][ev.note]++;
+            notes[batch[b].track]=ev.note;
+        }
 
-            if (ev.track->curnote>=0)
-                midiout.note_off(ev.track->channel, ev.track->curnote, 0);
+        for (Head& head: batch) {
+            const Track* track=tracks[head.track];
 
-            if (trev.velocity>0) {
-                midiout.note_on(ev.track->channel, trev.note, trev.velocity);
-                ev.track->curnote=trev.note;
+            if (++head.index<track->events.size()) {
+                head.tick=track->events[head.index].tick;
+                heads.push(head);
             }
-            else
-                ev.track->curnote=-1;
+        }
+    }
+}
+
+
+// Merges all tracks into the timeline once, starting from the notes currently sounding on
+// each track.
+void Sequencer::build_timeline()
+{
+    timelinenotes.clear();
+    for (const Track* track: tracks)
+        timelinenotes.push_back(track->curnote);
+
+    timeline.clear();
+    timelinelength=0;
+
+    for (const Track* track: tracks)
+        if (!track->events.empty())
+            timelinelength=std::max(timelinelength, track->events.back().tick);
+
+    std::vector<int8_t> notes=timelinenotes;
+
+    merge_tracks(notes, [this](int, uint32_t tick, const uint8_t* msg) {
+        timeline.push_back(TimelineEvent { tick, { msg[0], msg[1], msg[2] } });
+    });
 
-            if (++ev.index<ev.track->events.size())
-                queue.push(ev);
+    // the notes left sounding at the end, so that consecutive passes can tell whether they match
+    timelineendnotes=std::move(notes);
+}
+
+
+// hands one pass over the timeline to the output thread
+bool Sequencer::schedule_timeline()
+{
+    if (!started) {
+        origin=get_monotonic_time();
+        started=true;
+    }
+
+    const int64_t passstart=origin + ticks_to_nanoseconds(elapsedticks);
+    const int64_t now=get_monotonic_time();
+    if (now>passstart+resync_ns) {
+        origin+=now-passstart;
+        lateness.resyncs++;
+    }
+
+    const long previous=scheduled;
+
+    for (const TimelineEvent& ev: timeline) {
+        const int64_t deadline=origin + ticks_to_nanoseconds(elapsedticks+ev.tick);
+
+        if (!push_output(OutputEvent { deadline, { ev.message[0], ev.message[1], ev.message[2] }, 3 })) {
+            Stats::add(Stats::Counter::EventsScheduled, scheduled-previous);
+            return false;
         }
-    } while (loop);
+    }
+
+    Stats::add(Stats::Counter::EventsScheduled, scheduled-previous);
+
+    elapsedticks+=timelinelength;
+
+    for (int t=0;t<tracks.size();t++)
+        tracks[t]->curnote=timelineendnotes[t];
+
+    return true;
+}
+
+
+bool Sequencer::schedule()
+{
+    build_timeline();
+
+    return schedule_timeline();
+}
+
+
+bool Sequencer::wait_played(long count)
+{
+    // after an interruption, only wait for the output thread to turn off all notes
+    while (stopping ? !silenced : sent<count) {
+        const timespec ts { 0, producer_poll_ns };
+        nanosleep(&ts, nullptr);
+    }
+
+    return !stopping;
+}
+
+
+bool Sequencer::play(bool loop)
+{
+    Stats::ScopedTimer timer(Stats::Timer::Playback);
+
+    build_timeline();
+
+    while (schedule_timeline() && loop) {
+        // the timeline only needs to be merged again if a pass leaves different notes sounding
+        // than it started with, which the usual closing pauses prevent
+        if (timelineendnotes!=timelinenotes)
+            build_timeline();
+    }
+
+    return finish();
 }
 
 
+// may be called from a signal handler
 void Sequencer::stop()
 {
-    // noop - currently we rely on usleep returning an error upon a signal
+    stopping=true;
+}
+
+
+bool Sequencer::write_smf(const std::string& filename) const
+{
+    if (ticks_per_beat<=0 || ticks_per_beat>0x7fff || bpm<=0)
+        return false;
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+
+    std::vector<uint8_t> data;
+
+    smf_append_be(data, 1, 2);              // format
+    smf_append_be(data, tracks.size()+1, 2);
+    smf_append_be(data, ticks_per_beat, 2);
+    smf_write_chunk(file, "MThd", data);
+
+    // conductor track with the tempo
+    data.clear();
+    smf_append_tempo(data, 60000000/bpm);
+    smf_append_end_of_track(data, 0);
+    smf_write_chunk(file, "MTrk", data);
+
+    // note-offs are resolved as in the timeline, starting with nothing sounding
+    std::vector<std::vector<uint8_t>> trackdata(tracks.size());
+    std::vector<uint32_t> tracktick(tracks.size(), 0);
+
+    auto emit=[&](int t, uint32_t tick, const uint8_t* msg) {
+        smf_append_vlq(trackdata[t], tick-tracktick[t]);
+        trackdata[t].insert(trackdata[t].end(), msg, msg+3);
+        tracktick[t]=tick;
+    };
+
+    for (int t=0;t<tracks.size();t++) {
+        smf_append_vlq(trackdata[t], 0);
+        trackdata[t].push_back(0xc0|tracks[t]->channel);
+        trackdata[t].push_back(tracks[t]->program);
+    }
+
+    std::vector<int8_t> notes(tracks.size(), -1);
+    merge_tracks(notes, emit);
+
+    // each track ends with its last event, which is usually a closing pause, and turns off
+    // what it still holds, once per note and channel
+    bool off[16][128]={};
+
+    for (int t=0;t<tracks.size();t++) {
+        const Track* track=tracks[t];
+        const uint32_t end=track->events.empty() ? 0 : track->events.back().tick;
+
+        if (notes[t]>=0 && !off[track->channel][notes[t]]) {
+            const uint8_t msg[3]={ uint8_t(0x80|track->channel), uint8_t(notes[t]), 0 };
+            emit(t, end, msg);
+            off[track->channel][notes[t]]=true;
+        }
+
+        smf_append_end_of_track(trackdata[t], end-tracktick[t]);
+        smf_write_chunk(file, "MTrk", trackdata[t]);
+    }
+
+    return bool(file);
+}
+
+
+void Sequencer::clear()
+{
+    for (Track* track: tracks)
+        track->events.clear();
+}
+
+
+// sleeps and then spins until the deadline; returns false if interrupted
+bool Sequencer::wait_until(int64_t deadline)
+{
+    const int64_t wakeup=deadline-spin_ns;
+
+    for (int64_t now=get_monotonic_time(); now<wakeup; now=get_monotonic_time()) {
+        if (stopping || quit) return false;
+
+        // sleep in slices, as the interrupting signal is usually handled by another thread
+        const int64_t until=std::min(wakeup, now+output_poll_ns);
+
+        timespec ts;
+        ts.tv_sec =until/1000000000LL;
+        ts.tv_nsec=until%1000000000LL;
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+    }
+
+    while (!stopping && !quit && get_monotonic_time()<deadline);
+
+    return !stopping && !quit;
+}
+
+
+void Sequencer::silence()
+{
+    for (int ch=0;ch<16;ch++) {
+        for (int note=0;note<128;note++) {
+            if (sounding[ch][note]) {
+                const uint8_t msg[3]={ uint8_t(0x80|ch), uint8_t(note), 0 };
+                midiout.queue(msg, sizeof(msg));
+                sounding[ch][note]=0;
+            }
+        }
+    }
+
+    midiout.flush();
+}
+
+
+// The output thread only sends what the producer has put into the ring, each message at
+// its deadline.  After an interruption, it turns off all notes and discards the rest.
+void Sequencer::output()
+{
+    while (!quit) {
+        OutputEvent* ev=ring.front();
+
+        if (stopping) {
+            if (!silenced) {
+                silence();
+                silenced=true;
+            }
+
+            if (ev) {
+                ring.pop();
+                sent++;
+            }
+            else {
+                const timespec ts { 0, output_poll_ns };
+                nanosleep(&ts, nullptr);
+            }
+
+            continue;
+        }
+
+        if (!ev) {
+            const timespec ts { 0, output_poll_ns };
+            nanosleep(&ts, nullptr);
+            continue;
+        }
+
+        if (!wait_until(ev->deadline))
+            continue;
+
+        // everything due at the same time, e.g. all voices of a chord change, is submitted at once
+        const int64_t deadline=ev->deadline;
+        const int64_t now=get_monotonic_time();
+        long count=0;
+
+        do {
+            const int64_t late=now-ev->deadline;
+            lateness.events++;
+            lateness.total_ns+=late;
+            lateness.max_ns=std::max(lateness.max_ns, late);
+            if (late>1000000)
+                lateness.over_1ms++;
+
+            midiout.queue(ev->message, ev->size);
+
+            const int ch=ev->message[0]&15;
+            if ((ev->message[0]&0xf0)==0x90)
+                sounding[ch][ev->message[1]]=1;
+            else if ((ev->message[0]&0xf0)==0x80)
+                sounding[ch][ev->message[1]]=0;
+
+            ring.pop();
+            count++;
+
+            ev=ring.front();
+        } while (ev && ev->deadline<=deadline);
+
+        midiout.flush();
+        sent+=count;
+    }
 }
@@ -1,31 +1,65 @@
 #ifndef INCLUDE_MIDI_H
 #define INCLUDE_MIDI_H
 
-#include <RtMidi.h>
-
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+#include "midisink.h"
+#include "spscring.h"
+
+// Front end for sending MIDI messages to a sink.  Messages which are due at the same time
+// can be collected with queue and then handed to the sink in one call by flush.  Not
+// synchronized, so while a sequencer sends to it, only its output thread may use it.
 class MidiOut {
-    RtMidiOut&  rtmidiout;
-
 public:
-    MidiOut(RtMidiOut& rtmidiout):rtmidiout(rtmidiout) {}
+    MidiOut(MidiSink& sink):sink(&sink) {}
 
     void note_off(int ch, int note, int vel)
     {
         const uint8_t msg[3]={ uint8_t(0x80|ch), uint8_t(note), uint8_t(vel) };
-        rtmidiout.sendMessage(msg, sizeof(msg));
+        send(msg, sizeof(msg));
     }
 
     void note_on(int ch, int note, int vel)
     {
         const uint8_t msg[3]={ uint8_t(0x90|ch), uint8_t(note), uint8_t(vel) };
-        rtmidiout.sendMessage(msg, sizeof(msg));
+        send(msg, sizeof(msg));
+    }
+
+    void send(const uint8_t* msg, size_t size)
+    {
+        queue(msg, size);
+        flush();
     }
 
     void program_change(int ch, int prog)
     {
         const uint8_t msg[2]={ uint8_t(0xC0|ch), uint8_t(prog) };
-        rtmidiout.sendMessage(msg, sizeof(msg));
+        send(msg, sizeof(msg));
     }
+
+    void queue(const uint8_t* msg, size_t size)
+    {
+        batch.insert(batch.end(), msg, msg+size);
+        batchsizes.push_back(size);
+    }
+
+    void flush()
+    {
+        if (!batchsizes.empty())
+            sink->submit(batch.data(), batchsizes.data(), batchsizes.size());
+
+        batch.clear();
+        batchsizes.clear();
+    }
+
+private:
+    MidiSink*   sink;
+
+    std::vector<uint8_t>    batch;
+    std::vector<size_t>     batchsizes;
 };
 
 
@@ -36,41 +70,171 @@ public:
     class Track {
         friend class Sequencer;
 
+        // packed into 8 bytes, so long pieces stay compact
         struct Event {
-            float   timestamp;
-            uint8_t note;
-            uint8_t velocity;
+            uint32_t    tick;
+            uint8_t     note;
+            uint8_t     velocity;
         };
 
+        static_assert(sizeof(Event)==8, "track events should take 8 bytes");
+
         std::vector<Event> events;
 
         int8_t  channel;
+        int8_t  program;
         int8_t  curnote=-1;
         int8_t  transposition=0;
+        bool    tie_notes=false;
 
-        Track(int8_t channel, int8_t transposition);
+        Track(int8_t channel, int8_t program, int8_t transposition);
 
     public:
-        void append_note(float timestamp, const Note& note, uint8_t vel);
-        void append_note(float timestamp, uint8_t note, uint8_t vel);
-        void append_pause(float timestamp);
+        // positions in ticks of the sequencer
+        void append_note(uint32_t tick, const Note& note, uint8_t vel);
+        void append_note(uint32_t tick, uint8_t note, uint8_t vel);
+        void append_pause(uint32_t tick);
+
+        // hold a note which is repeated right away instead of striking it again
+        void set_tie_notes(bool tie)
+        {
+            tie_notes=tie;
+        }
     };
 
-    Sequencer(MidiOut&, int bpm, int transposition);
+    // how late events were sent compared to their deadlines
+    struct LatenessStats {
+        long    events=0;
+        int64_t total_ns=0;
+        int64_t max_ns=0;
+        long    over_1ms=0;
+        long    resyncs=0;      // restarts of the clock after falling behind by more than resync_ns
+    };
+
+    // default resolution of the schedule
+    const static int default_ticks_per_beat=960;
+
+    Sequencer(MidiOut&, int bpm, int transposition, int ticks_per_beat=default_ticks_per_beat);
+    ~Sequencer();
 
     Track* add_track(int8_t channel, int8_t program);
 
-    void play(bool loop);
+    // sent by the output thread right away, ahead of anything scheduled afterwards
+    bool program_change(int8_t channel, int8_t program);
+
+    int get_ticks_per_beat() const
+    {
+        return ticks_per_beat;
+    }
+
+    // Events are sent at absolute deadlines from a monotonic clock, which keeps running across
+    // loop passes and successive calls, so the timing does not drift.  Returns when everything
+    // has been played, or false if playback was interrupted.
+    bool play(bool loop);
     void stop();
 
+    // Hands the events of the tracks over to the output thread without waiting for them to be
+    // played, e.g. to play an ongoing piece chunk by chunk; blocks while the output ring is full.
+    bool schedule();
+
+    long get_scheduled_count() const
+    {
+        return scheduled;
+    }
+
+    // waits until the first count scheduled events have been played
+    bool wait_played(long count);
+
+    bool finish()
+    {
+        return wait_played(scheduled);
+    }
+
+    // Writes the tracks as a type 1 Standard MIDI File, with a conductor track for the tempo and
+    // one track per sequencer track, independent of playback.  Returns false if the file could
+    // not be written or the resolution does not fit into the header.
+    bool write_smf(const std::string& filename) const;
+
+    // removes all events from the tracks, e.g. to play the next chunk of an ongoing piece
+    void clear();
+
+    // busy-wait for the given time before each deadline instead of sleeping, for lower jitter
+    void set_spin_time(int microseconds)
+    {
+        spin_ns=microseconds*1000LL;
+    }
+
+    // runs the output thread with SCHED_FIFO at the given priority and locks all memory
+    bool set_realtime_priority(int priority);
+
+    // only consistent while nothing is playing
+    const LatenessStats& get_lateness_stats() const
+    {
+        return lateness;
+    }
+
 private:
+    // a message for the output thread, which alone sends to the MidiOut
+    struct OutputEvent {
+        int64_t deadline;
+        uint8_t message[3];
+        uint8_t size;
+    };
+
+    const static size_t output_ring_size=4096;
+
+    // all tracks merged into one message sequence, with the note-offs in place
+    struct TimelineEvent {
+        uint32_t    tick;
+        uint8_t     message[3];
+    };
+
+    template<typename Emit>
+    void merge_tracks(std::vector<int8_t>& notes, Emit emit) const;
+
+    void build_timeline();
+    bool schedule_timeline();
+
+    int64_t ticks_to_nanoseconds(int64_t ticks) const;
+    bool push_output(const OutputEvent&);
+
+    // the output thread and its helpers
+    void output();
+    bool wait_until(int64_t deadline);
+    void silence();
+
     MidiOut&    midiout;
 
     std::vector<Track*> tracks;
 
     int transposition=0;
     int bpm=0;
-
+    int ticks_per_beat=default_ticks_per_beat;
+
+    // producer state
+    bool    started=false;
+    int64_t origin=0;           // monotonic time of tick 0
+    int64_t elapsedticks=0;     // length of all previously played passes
+    long    scheduled=0;
+
+    std::vector<TimelineEvent>  timeline;
+    uint32_t                    timelinelength=0;
+    std::vector<int8_t>         timelinenotes;      // notes sounding on each track before and after
+    std::vector<int8_t>         timelineendnotes;
+
+    // shared with the output thread
+    SpscRing<OutputEvent, output_ring_size> ring;
+    std::atomic<long>       sent { 0 };
+    std::atomic<bool>       silenced { false };
+    std::atomic<bool>       quit { false };
+    std::atomic<bool>       stopping { false };     // lock-free, so stop may set it from a signal handler
+    int64_t                 spin_ns=0;
+
+    // output thread state
+    uint8_t         sounding[16][128]={};
+    LatenessStats   lateness;
+
+    std::thread     outputthread;
 };
 
 
@@ -0,0 +1,160 @@
+#include <fstream>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <RtMidi.h>
+#include "midisink.h"
+#include "smf.h"
+
+
+int64_t get_monotonic_time()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+
+void RtMidiSink::submit(const uint8_t* data, const size_t* sizes, size_t count)
+{
+    for (size_t i=0;i<count;i++) {
+        rtmidiout.sendMessage(data, sizes[i]);
+        data+=sizes[i];
+    }
+}
+
+
+void RawMidiSink::submit(const uint8_t* data, const size_t* sizes, size_t count)
+{
+    buffer.clear();
+
+    for (size_t i=0;i<count;i++) {
+        const uint8_t* msg=data;
+        const size_t size=sizes[i];
+        data+=size;
+
+        if (!size) continue;
+
+        uint8_t status=msg[0];
+
+        // a note-off without velocity is the same as a note-on with velocity zero, which can
+        // share the running status with the note-ons on the same channel
+        if ((status&0xf0)==0x80 && size==3 && !msg[2])
+            status=0x90|(status&15);
+
+        if (status>=0x80 && status<0xf0) {
+            if (status!=runningstatus)
+                buffer.push_back(status);
+
+            runningstatus=status;
+            buffer.insert(buffer.end(), msg+1, msg+size);
+        }
+        else {
+            // system messages cancel the running status, except for real-time messages
+            if (status<0xf8)
+                runningstatus=0;
+
+            buffer.insert(buffer.end(), msg, msg+size);
+        }
+    }
+
+    for (size_t done=0;done<buffer.size();) {
+        const ssize_t n=write(fd, buffer.data()+done, buffer.size()-done);
+        if (n<0) {
+            if (errno==EINTR) continue;
+
+            // the device may have missed a status byte
+            runningstatus=0;
+            break;
+        }
+
+        done+=n;
+    }
+}
+
+
+void RecordingMidiSink::submit(const uint8_t* data, const size_t* sizes, size_t count)
+{
+    const int64_t now=get_monotonic_time();
+
+    for (size_t i=0;i<count;i++) {
+        messages.push_back(Message { now, bytes.size(), sizes[i] });
+        bytes.insert(bytes.end(), data, data+sizes[i]);
+        data+=sizes[i];
+    }
+}
+
+
+void RecordingMidiSink::clear()
+{
+    messages.clear();
+    bytes.clear();
+}
+
+
+SmfMidiSink::SmfMidiSink(const std::string& filename, int ticks_per_quarter):filename(filename), ticks_per_quarter(ticks_per_quarter)
+{
+}
+
+
+SmfMidiSink::~SmfMidiSink()
+{
+    if (!closed)
+        close();
+}
+
+
+bool SmfMidiSink::close()
+{
+    closed=true;
+
+    if (ticks_per_quarter<=0 || ticks_per_quarter>0x7fff)
+        return false;
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+        return false;
+
+    std::vector<uint8_t> data;
+
+    smf_append_be(data, 0, 2);              // format
+    smf_append_be(data, 1, 2);
+    smf_append_be(data, ticks_per_quarter, 2);
+    smf_write_chunk(file, "MThd", data);
+
+    // at the default tempo of 120 quarters per minute, so ticks are proportional to time
+    const int64_t ns_per_quarter=500000000;
+
+    data.clear();
+    smf_append_tempo(data, ns_per_quarter/1000);
+
+    const int64_t start=get_message_count() ? get_message(0).time : 0;
+    uint32_t tick=0;
+
+    for (size_t i=0;i<get_message_count();i++) {
+        const Message& msg=get_message(i);
+        const uint8_t* bytes=get_message_data(i);
+
+        // only channel messages and system exclusive can be stored in the file
+        if (!msg.size || (bytes[0]<0x80) || (bytes[0]>=0xf0 && bytes[0]!=0xf0))
+            continue;
+
+        const uint32_t t=(msg.time-start)*ticks_per_quarter/ns_per_quarter;
+        smf_append_vlq(data, t-tick);
+        tick=t;
+
+        if (bytes[0]==0xf0) {
+            data.push_back(0xf0);
+            smf_append_vlq(data, msg.size-1);
+            data.insert(data.end(), bytes+1, bytes+msg.size);
+        }
+        else
+            data.insert(data.end(), bytes, bytes+msg.size);
+    }
+
+    smf_append_end_of_track(data, 0);
+    smf_write_chunk(file, "MTrk", data);
+
+    return bool(file);
+}
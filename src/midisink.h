@@ -0,0 +1,115 @@
+#ifndef INCLUDE_MIDISINK_H
+#define INCLUDE_MIDISINK_H
+
+#include <string>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+
+class RtMidiOut;
+
+// nanoseconds on CLOCK_MONOTONIC, which the sequencer schedules by
+int64_t get_monotonic_time();
+
+
+// Destination of the MIDI messages sent through MidiOut.
+class MidiSink {
+public:
+    virtual ~MidiSink() {}
+
+    // Messages due at the same time, stored one after another in data.  Each of them is
+    // complete, i.e. without running status.  Whether they reach the device in one piece
+    // depends on the sink: only RawMidiSink writes them at once.
+    virtual void submit(const uint8_t* data, const size_t* sizes, size_t count)=0;
+
+    // called after playback; returns false if anything could not be delivered
+    virtual bool close()
+    {
+        return true;
+    }
+};
+
+
+// discards everything, e.g. when only rendering to a file
+class NullMidiSink:public MidiSink {
+public:
+    void submit(const uint8_t*, const size_t*, size_t) override {}
+};
+
+
+// RtMidi takes one message per call, as some of its backends cannot take several in one
+// buffer, so a batch still means one sendMessage per message, only without a pause between
+class RtMidiSink:public MidiSink {
+    RtMidiOut&  rtmidiout;
+
+public:
+    RtMidiSink(RtMidiOut& rtmidiout):rtmidiout(rtmidiout) {}
+
+    void submit(const uint8_t* data, const size_t* sizes, size_t count) override;
+};
+
+
+// A raw MIDI device such as /dev/snd/midiC1D0, which takes a plain byte stream.  Each
+// submission is a single write using running status.
+class RawMidiSink:public MidiSink {
+    int                     fd;
+    uint8_t                 runningstatus=0;
+    std::vector<uint8_t>    buffer;
+
+public:
+    explicit RawMidiSink(int fd):fd(fd) {}
+
+    void submit(const uint8_t* data, const size_t* sizes, size_t count) override;
+};
+
+
+// Keeps all messages in memory together with the monotonic time of their submission, e.g.
+// to measure the timing of the sequencer without a synthesizer.
+class RecordingMidiSink:public MidiSink {
+public:
+    struct Message {
+        int64_t time;
+        size_t  offset;         // into the recorded bytes
+        size_t  size;
+    };
+
+    void submit(const uint8_t* data, const size_t* sizes, size_t count) override;
+
+    size_t get_message_count() const
+    {
+        return messages.size();
+    }
+
+    const Message& get_message(size_t i) const
+    {
+        return messages[i];
+    }
+
+    const uint8_t* get_message_data(size_t i) const
+    {
+        return bytes.data() + messages[i].offset;
+    }
+
+    void clear();
+
+private:
+    std::vector<Message>    messages;
+    std::vector<uint8_t>    bytes;
+};
+
+
+// Records the messages as they are played and writes them as a type 0 Standard MIDI File
+// with their actual timing when closed.
+class SmfMidiSink:public RecordingMidiSink {
+    std::string filename;
+    int         ticks_per_quarter;
+    bool        closed=false;
+
+public:
+    SmfMidiSink(const std::string& filename, int ticks_per_quarter=960);
+    ~SmfMidiSink();
+
+    bool close() override;
+};
+
+#endif
@@ -58,6 +58,30 @@ NoteClass::NoteClass(const std::string& name)
 }
 
 
+bool parse_note_class(const char*& p, const char* end, NoteClass& note)
+{
+    const static NoteName names[]={ NoteName::A, NoteName::B, NoteName::C, NoteName::D, NoteName::E, NoteName::F, NoteName::G };
+
+    if (p==end || *p<'A' || *p>'G')
+        return false;
+
+    const NoteName base=names[*p++ - 'A'];
+    int8_t value=notevalues[(int8_t) base];
+
+    if (p!=end && *p=='#') {
+        if (++value==12) value=0;
+        p++;
+    }
+    else if (p!=end && *p=='b') {
+        if (--value<0) value=11;
+        p++;
+    }
+
+    note=NoteClass(base, value);
+    return true;
+}
+
+
 std::string NoteClass::get_name() const
 {
     std::string name(1, notenames[(int8_t) base]);
@@ -67,6 +67,12 @@ public:
         return base>NoteName::Invalid;
     }
 
+    // either a note class or the empty one, e.g. for notes read from a file
+    bool is_valid() const
+    {
+        return base==NoteName::Invalid ? value==-1 : base<=NoteName::B && value>=0 && value<12;
+    }
+
     std::string get_name() const;
 
     NoteClass operator+(const Interval&) const;
@@ -91,6 +97,11 @@ public:
 };
 
 
+// Parses a note name like C, F# or Bb from the characters up to end and advances p past it,
+// without allocating.
+bool parse_note_class(const char*& p, const char* end, NoteClass&);
+
+
 class Note {
     friend class Scale;
 
@@ -124,6 +135,12 @@ public:
         return base>NoteName::Invalid;
     }
 
+    // a note within the MIDI range, e.g. for notes read from a file
+    bool is_valid() const
+    {
+        return base>NoteName::Invalid && base<=NoteName::B && value>=0;
+    }
+
     std::string get_name() const;
 
     uint8_t get_midi_note() const
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <sstream>
+#include <stdio.h>
+#include "chordparser.h"
+#include "progression.h"
+#include "stats.h"
+
+
+std::string json_quote(const std::string& str)
+{
+    std::string quoted="\"";
+
+    for (char c: str) {
+        if (c=='"' || c=='\\')
+            quoted+='\\';
+
+        if (uint8_t(c)<0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            quoted+=buf;
+        }
+        else
+            quoted+=c;
+    }
+
+    return quoted + '"';
+}
+
+
+std::string get_plain_note_name(const Note& note)
+{
+    std::string name=note.get_name();
+    name.erase(std::remove(name.begin(), name.end(), '-'), name.end());
+
+    return name;
+}
+
+
+bool parse_progression(const std::string& text, const ProgressionOptions& options, std::vector<Chord>& chords, std::string& error)
+{
+    Stats::ScopedTimer timer(Stats::Timer::Parse);
+
+    ChordParser parsechord;
+
+    std::istringstream tokens(text);
+    std::string token;
+    while (tokens >> token) {
+        auto chord=parsechord(token.c_str());
+        if (!chord.has_value()) {
+            error="invalid chord '" + token + "'";
+            return false;
+        }
+
+        chords.push_back(*chord);
+    }
+
+    Stats::add(Stats::Counter::ChordsParsed, chords.size());
+
+    if (options.transpose_to && !chords.empty()) {
+        Interval trans=*options.transpose_to - chords[0].notes[0];
+        for (auto& c: chords)
+            c+=trans;
+    }
+
+    return true;
+}
+
+
+int voice_progression(VoicingCache& voicingcache, ThreadPool& threadpool, std::vector<Bar>& bars, const ProgressionOptions& options)
+{
+    const int cost=compute_voice_leading(voicingcache, threadpool, bars, options.loop);
+    compute_scales_for_chords(bars);
+
+    return cost;
+}
+
+
+void append_progression_json(const Ensemble& ensemble, const std::vector<Bar>& bars, int cost, std::string& output)
+{
+    output+="\"cost\":" + std::to_string(cost) + ",\"bars\":[";
+
+    for (int i=0;i<bars.size();i++) {
+        if (i) output+=',';
+
+        output+="{\"chord\":" + json_quote(bars[i].chord.get_name()) + ",\"scale\":" + json_quote(bars[i].scale.get_name()) + ",\"voicing\":[";
+
+        for (int j=0;j<ensemble.get_harmony_voice_count();j++) {
+            if (j) output+=',';
+            output+=json_quote(get_plain_note_name(bars[i].voicing[j]));
+        }
+
+        output+="]}";
+    }
+
+    output+=']';
+}
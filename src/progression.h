@@ -0,0 +1,43 @@
+#ifndef INCLUDE_PROGRESSION_H
+#define INCLUDE_PROGRESSION_H
+
+#include <optional>
+#include <string>
+#include <vector>
+#include "voiceleading.h"
+
+
+// How a progression is voiced and arranged, as set on the command line of chordplay.
+struct ProgressionOptions {
+    bool    loop=false;             // the progression repeats, so the last bar leads to the first
+    bool    embellish=false;        // approach the next bar with passing notes in the harmony voices
+    bool    tie=false;              // hold harmony notes which stay the same in the next bar
+    bool    improvise=false;        // improvise a melody for the first melody voice
+
+    uint32_t    seed=0;             // of the random choices when improvising
+
+    std::optional<NoteClass>    transpose_to;   // the root of the first chord
+};
+
+
+/*
+ * Entry points for voicing whole progressions.  They keep no state of their own, so any
+ * number of them may run concurrently in one process, also sharing a voicing cache and a
+ * thread pool.
+ */
+
+// Parses chord names separated by whitespace, or returns false with an error message.
+bool parse_progression(const std::string& text, const ProgressionOptions&, std::vector<Chord>&, std::string& error);
+
+// finds the voicings and scales of all bars and returns the cost of the voice leading
+int voice_progression(VoicingCache&, ThreadPool&, std::vector<Bar>&, const ProgressionOptions&);
+
+// the members of a JSON object describing a voiced progression
+void append_progression_json(const Ensemble&, const std::vector<Bar>&, int cost, std::string& output);
+
+std::string json_quote(const std::string&);
+
+// without the padding for natural notes, e.g. C4 or F#3
+std::string get_plain_note_name(const Note&);
+
+#endif
@@ -1,81 +1,94 @@
-#include <regex>
 #include "rhythmparser.h"
 
 
-struct RhythmParser::Internal {
-    std::regex regex {
-        "[[:space:]]*"
-        "([[:lower:]]+)"    // role
-        "[[:space:]]+"
-        "([[:digit:]]+)"    // MIDI channel
-        "[[:space:]]+"
-        "([[:digit:]]+)"    // MIDI program (instrument/drum kit)
-        "[[:space:]]+"
-        "([[:digit:]]+)"    // MIDI note
-        "[[:space:]]+"
-        "([[:digit:]]+)"    // MIDI velocity (on-beat)
-        "[[:space:]]+"
-        "([[:digit:]]+)"    // MIDI velocity (off-beat)
-        "[[:space:]]+"
-        "(\\.*(?:[Xx]_*\\.*)+)"     // default pattern
-        "(?:[[:space:]]+"
-        "(\\.*(?:[Xx]_*\\.*)+))?"   // loop end pattern
-        "[[:space:]]*"
-        "(?:;.*)"           // comment
-    };
-};
-
-
-RhythmParser::RhythmParser()
+// A pattern has one character per step: X or x strikes a note strongly or weakly, _ holds it
+// and . rests.  It has to strike at least once, and can only hold right after a strike.
+bool RhythmParser::parse_pattern(DefinitionScanner& scanner, std::string_view field, const char* what, std::string& pattern) const
 {
-    internal=new Internal;
-}
+    bool struck=false;
+    bool valid=!field.empty();
+    char prev='.';
 
+    for (char c: field) {
+        if (c=='X' || c=='x')
+            struck=true;
+        else if (c!='.' && (c!='_' || prev=='.'))
+            valid=false;
 
-RhythmParser::~RhythmParser()
-{
-    delete internal;
+        prev=c;
+    }
+
+    if (!valid || !struck) {
+        scanner.error(field, field.empty() ? std::string("missing ") + what : std::string("invalid ") + what + " '" + std::string(field) + "'");
+        return false;
+    }
+
+    pattern=field;
+    return true;
 }
 
 
-Rhythm::Voice RhythmParser::parse_voice(const std::string& line) const
+/*
+ * Each line of a rhythm definition describes one voice:
+ *
+ *   role  MIDI-channel  MIDI-program  MIDI-note  velocity-strong  velocity-weak  pattern  [loop-end-pattern]  ; comment
+ *
+ * with role either percussion or bass.
+ */
+bool RhythmParser::parse_voice(DefinitionScanner& scanner, Rhythm::Voice& voice) const
 {
-    std::smatch result;
-    if (!std::regex_match(line, result, internal->regex)) {
-        std::cerr << "Error parsing rhythm definition: Invalid voice definition\n" << line << std::endl;
-        exit(1);
-    }
-
-    Rhythm::Voice voice;
+    bool valid=true;
 
-    if (result[1]=="percussion")
+    const std::string_view role=scanner.next_field();
+    if (role=="percussion")
         voice.role=Rhythm::Voice::Role::Percussion;
-    else if (result[1]=="bass")
+    else if (role=="bass")
         voice.role=Rhythm::Voice::Role::Bass;
     else {
-        std::cerr << "Error parsing rhythm definition: Invalid voice role " << result[1] << std::endl;
-        exit(1);
+        scanner.error(role, "invalid voice role '" + std::string(role) + "'");
+        valid=false;
     }
 
-    voice.midi_channel=std::stoi(result[2]);
-    voice.midi_program=std::stoi(result[3]);
-    voice.midi_note   =std::stoi(result[4]);
-    voice.midi_velocity_strong=std::stoi(result[5]);
-    voice.midi_velocity_weak  =std::stoi(result[6]);
-    voice.pattern=result[7];
-    voice.loop_end_pattern=result[8];
+    int channel=0, program=0, note=0, strong=0, weak=0;
+    valid&=scanner.parse_int(scanner.next_field(), "MIDI channel", 0, 15, channel);
+    valid&=scanner.parse_int(scanner.next_field(), "MIDI program", 0, 127, program);
+    valid&=scanner.parse_int(scanner.next_field(), "MIDI note", 0, 127, note);
+    valid&=scanner.parse_int(scanner.next_field(), "strong MIDI velocity", 0, 127, strong);
+    valid&=scanner.parse_int(scanner.next_field(), "weak MIDI velocity", 0, 127, weak);
+    valid&=parse_pattern(scanner, scanner.next_field(), "pattern", voice.pattern);
+
+    const std::string_view loopend=scanner.next_field();
+    if (!loopend.empty()) {
+        valid&=parse_pattern(scanner, loopend, "loop end pattern", voice.loop_end_pattern);
+        valid&=scanner.expect_end_of_line();
+    }
+
+    voice.midi_channel=channel;
+    voice.midi_program=program;
+    voice.midi_note   =note;
+    voice.midi_velocity_strong=strong;
+    voice.midi_velocity_weak  =weak;
 
-    return voice;
+    return valid;
 }
 
 
-Rhythm RhythmParser::operator()(std::istream& istr) const
+Rhythm RhythmParser::operator()(std::string_view text, std::vector<ParseDiagnostic>& diagnostics) const
 {
     Rhythm rhythm;
+    DefinitionScanner scanner(text, diagnostics);
 
-    std::string line;
-    while (getline(istr, line))
-        rhythm.add_voice(parse_voice(line));
+    while (scanner.next_line()) {
+        Rhythm::Voice voice;
+        if (parse_voice(scanner, voice))
+            rhythm.add_voice(voice);
+    }
 
     return rhythm;
 }
+
+
+Rhythm RhythmParser::operator()(std::istream& istr, std::vector<ParseDiagnostic>& diagnostics) const
+{
+    return (*this)(read_definition(istr), diagnostics);
+}
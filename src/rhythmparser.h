@@ -2,20 +2,20 @@
 #define INCLUDE_RHYTHMPARSER_H
 
 #include <iostream>
+#include <string_view>
+#include <vector>
 #include "rhythm.h"
+#include "definitionparser.h"
 
 class RhythmParser {
-    struct Internal;
-
-    Internal*   internal;
-
-    Rhythm::Voice parse_voice(const std::string&) const;
+    bool parse_voice(DefinitionScanner&, Rhythm::Voice&) const;
+    bool parse_pattern(DefinitionScanner&, std::string_view field, const char* what, std::string& pattern) const;
 
 public:
-    RhythmParser();
-    ~RhythmParser();
-
-    Rhythm operator()(std::istream&) const;
+    // Invalid lines are skipped and reported in the diagnostics, so the rhythm is only
+    // complete if there are none.
+    Rhythm operator()(std::string_view text, std::vector<ParseDiagnostic>&) const;
+    Rhythm operator()(std::istream&, std::vector<ParseDiagnostic>&) const;
 };
 
 #endif
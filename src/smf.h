@@ -0,0 +1,55 @@
+#ifndef INCLUDE_SMF_H
+#define INCLUDE_SMF_H
+
+#include <ostream>
+#include <vector>
+#include <stdint.h>
+
+// helpers for writing Standard MIDI Files
+
+inline void smf_append_be(std::vector<uint8_t>& data, uint32_t value, int size)
+{
+    while (size--)
+        data.push_back(uint8_t(value>>(8*size)));
+}
+
+
+// delta times are stored as variable-length quantities, seven bits per byte
+inline void smf_append_vlq(std::vector<uint8_t>& data, uint32_t value)
+{
+    int size=1;
+    while (size<5 && value>>(7*size))
+        size++;
+
+    while (--size)
+        data.push_back(uint8_t(0x80|(value>>(7*size))));
+
+    data.push_back(uint8_t(value&0x7f));
+}
+
+
+inline void smf_write_chunk(std::ostream& file, const char* type, const std::vector<uint8_t>& body)
+{
+    std::vector<uint8_t> header(type, type+4);
+    smf_append_be(header, body.size(), 4);
+
+    file.write((const char*) header.data(), header.size());
+    file.write((const char*) body.data(), body.size());
+}
+
+
+inline void smf_append_tempo(std::vector<uint8_t>& data, uint32_t microseconds_per_quarter)
+{
+    smf_append_vlq(data, 0);
+    data.insert(data.end(), { 0xff, 0x51, 0x03 });
+    smf_append_be(data, microseconds_per_quarter, 3);
+}
+
+
+inline void smf_append_end_of_track(std::vector<uint8_t>& data, uint32_t delta)
+{
+    smf_append_vlq(data, delta);
+    data.insert(data.end(), { 0xff, 0x2f, 0x00 });
+}
+
+#endif
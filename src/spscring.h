@@ -0,0 +1,52 @@
+#ifndef INCLUDE_SPSCRING_H
+#define INCLUDE_SPSCRING_H
+
+#include <atomic>
+#include <stddef.h>
+
+
+// Lock-free ring buffer for exactly one producer and one consumer thread.
+// Capacity has to be a power of two.
+template<typename T, size_t Capacity>
+class SpscRing {
+    static_assert((Capacity&(Capacity-1))==0, "capacity must be a power of two");
+
+public:
+    // producer side; fails if the ring is full
+    bool push(const T& item)
+    {
+        const size_t t=tail.load(std::memory_order_relaxed);
+        if (t-head.load(std::memory_order_acquire)==Capacity)
+            return false;
+
+        items[t&(Capacity-1)]=item;
+        tail.store(t+1, std::memory_order_release);
+
+        return true;
+    }
+
+    // consumer side; the oldest item or nullptr if the ring is empty
+    T* front()
+    {
+        const size_t h=head.load(std::memory_order_relaxed);
+        if (h==tail.load(std::memory_order_acquire))
+            return nullptr;
+
+        return &items[h&(Capacity-1)];
+    }
+
+    // consumer side; removes the item returned by front
+    void pop()
+    {
+        head.store(head.load(std::memory_order_relaxed)+1, std::memory_order_release);
+    }
+
+private:
+    // on separate cache lines, so producer and consumer do not contend
+    alignas(64) std::atomic<size_t> head { 0 };
+    alignas(64) std::atomic<size_t> tail { 0 };
+
+    T   items[Capacity];
+};
+
+#endif
@@ -0,0 +1,88 @@
+#include <iterator>
+#include <stdio.h>
+#include "stats.h"
+#include "midisink.h"
+
+
+bool                    Stats::enabled=false;
+std::atomic<int64_t>    Stats::timers[int(Timer::Count)];
+std::atomic<int64_t>    Stats::counters[int(Counter::Count)];
+
+
+static const char* const timer_names[]={
+    "parse",
+    "enumerate",
+    "voice_leading",
+    "scales",
+    "render",
+    "playback"
+};
+
+static const char* const counter_names[]={
+    "chords_parsed",
+    "voicing_tables",
+    "voicings_enumerated",
+    "voicings_rejected",
+    "transitions",
+    "parallel_motions",
+    "events_scheduled",
+    "events_played",
+    "late_events",
+    "lateness_total_ns",
+    "lateness_max_ns"
+};
+
+static_assert(std::size(timer_names)==int(Stats::Timer::Count), "every timer needs a name");
+static_assert(std::size(counter_names)==int(Stats::Counter::Count), "every counter needs a name");
+
+
+int64_t Stats::get_time()
+{
+    return get_monotonic_time();
+}
+
+
+void Stats::max(Counter counter, int64_t value)
+{
+    if (!enabled) return;
+
+    auto& stat=counters[int(counter)];
+    for (int64_t cur=stat.load(std::memory_order_relaxed); value>cur && !stat.compare_exchange_weak(cur, value, std::memory_order_relaxed););
+}
+
+
+void Stats::print(std::ostream& os)
+{
+    char buf[64];
+
+    for (int i=0;i<int(Timer::Count);i++) {
+        snprintf(buf, sizeof(buf), "%-24s%14.3f ms", timer_names[i], timers[i]*1e-6);
+        os << buf << std::endl;
+    }
+
+    for (int i=0;i<int(Counter::Count);i++) {
+        snprintf(buf, sizeof(buf), "%-24s%14lld", counter_names[i], (long long) counters[i].load());
+        os << buf << std::endl;
+    }
+}
+
+
+std::string Stats::get_json()
+{
+    std::string json="{\"timers\":{";
+    char buf[64];
+
+    for (int i=0;i<int(Timer::Count);i++) {
+        snprintf(buf, sizeof(buf), "%s\"%s\":%.9f", i ? "," : "", timer_names[i], timers[i]*1e-9);
+        json+=buf;
+    }
+
+    json+="},\"counters\":{";
+
+    for (int i=0;i<int(Counter::Count);i++) {
+        snprintf(buf, sizeof(buf), "%s\"%s\":%lld", i ? "," : "", counter_names[i], (long long) counters[i].load());
+        json+=buf;
+    }
+
+    return json + "}}";
+}
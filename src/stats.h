@@ -0,0 +1,92 @@
+#ifndef INCLUDE_STATS_H
+#define INCLUDE_STATS_H
+
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <stdint.h>
+
+
+/*
+ * Counters and timers showing where the time of a run goes, as printed with --stats.
+ * Nothing is recorded unless enable() was called before the work starts, so when disabled
+ * every point of measurement costs a single predictable branch.  Hot loops count into local
+ * variables and add them once per block of work.  All values are summed over all threads.
+ */
+class Stats {
+public:
+    enum class Timer {
+        Parse,
+        Enumerate,
+        VoiceLeading,
+        Scales,
+        Render,
+        Playback,
+        Count
+    };
+
+    enum class Counter {
+        ChordsParsed,
+        VoicingTables,          // chords whose voicings were enumerated, i.e. cache misses
+        VoicingsEnumerated,
+        VoicingsRejected,       // partial voicings pruned for crossing voices or missing chord tones
+        Transitions,            // voice leading costs evaluated by the dynamic programs
+        ParallelMotions,        // forbidden parallels in the chosen voice leadings
+        EventsScheduled,
+        EventsPlayed,
+        LateEvents,             // played more than 1 ms after their deadline
+        LatenessTotal,          // in nanoseconds
+        LatenessMax,
+        Count
+    };
+
+    // adds the time from its construction to its destruction to a timer
+    class ScopedTimer {
+        const Timer     timer;
+        const int64_t   start;
+
+    public:
+        explicit ScopedTimer(Timer timer):timer(timer), start(enabled ? get_time() : 0) {}
+
+        ~ScopedTimer()
+        {
+            if (enabled)
+                timers[int(timer)].fetch_add(get_time()-start, std::memory_order_relaxed);
+        }
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+    };
+
+    static void enable()
+    {
+        enabled=true;
+    }
+
+    static bool is_enabled()
+    {
+        return enabled;
+    }
+
+    static void add(Counter counter, int64_t value)
+    {
+        if (enabled)
+            counters[int(counter)].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    static void max(Counter counter, int64_t value);
+
+    static void print(std::ostream&);
+
+    // a single JSON object, with the times in seconds
+    static std::string get_json();
+
+private:
+    static int64_t get_time();
+
+    static bool                 enabled;
+    static std::atomic<int64_t> timers[int(Timer::Count)];
+    static std::atomic<int64_t> counters[int(Counter::Count)];
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include <algorithm>
+#include "threadpool.h"
+
+static thread_local bool in_pool_thread=false;
+
+
+ThreadPool::ThreadPool(int numthreads)
+{
+    if (numthreads<=0)
+        numthreads=std::max(1u, std::thread::hardware_concurrency());
+
+    for (int i=1;i<numthreads;i++)
+        threads.emplace_back(&ThreadPool::worker, this);
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit=true;
+    }
+
+    wakeup.notify_all();
+
+    for (std::thread& thread: threads)
+        thread.join();
+}
+
+
+void ThreadPool::worker()
+{
+    in_pool_thread=true;
+
+    unsigned seen=0;
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wakeup.wait(lock, [&]() { return quit || generation!=seen; });
+
+            if (quit) return;
+
+            seen=generation;
+        }
+
+        run_chunks();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--active==0)
+            finished.notify_one();
+    }
+}
+
+
+void ThreadPool::run_chunks()
+{
+    for (int begin=nextindex.fetch_add(jobgrain);begin<jobsize;begin=nextindex.fetch_add(jobgrain))
+        (*job)(begin, std::min(begin+jobgrain, jobsize));
+}
+
+
+void ThreadPool::parallel_for(int n, int grain, const std::function<void(int, int)>& func)
+{
+    if (n<=0) return;
+
+    if (grain<1) grain=1;
+
+    if (threads.empty() || n<=grain || in_pool_thread) {
+        func(0, n);
+        return;
+    }
+
+    std::lock_guard<std::mutex> joblock(jobmutex);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        job=&func;
+        jobsize=n;
+        jobgrain=grain;
+        nextindex=0;
+        active=threads.size();
+        generation++;
+    }
+
+    wakeup.notify_all();
+
+    in_pool_thread=true;
+    run_chunks();
+    in_pool_thread=false;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [this]() { return active==0; });
+
+    job=nullptr;
+}
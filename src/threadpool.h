@@ -0,0 +1,53 @@
+#ifndef INCLUDE_THREADPOOL_H
+#define INCLUDE_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+class ThreadPool {
+public:
+    // numthreads includes the calling thread; 0 means one thread per CPU core
+    explicit ThreadPool(int numthreads=0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int get_thread_count() const
+    {
+        return threads.size() + 1;
+    }
+
+    // Calls func(begin, end) for consecutive chunks of at most grain indices covering [0, n)
+    // and returns when all of them are done.  Chunks are handed out in ascending order.
+    // Without workers, for n<=grain and for calls from within a pool thread, func is instead
+    // called once with all of [0, n) on the calling thread, which saves the per-chunk setup.
+    void parallel_for(int n, int grain, const std::function<void(int, int)>& func);
+
+private:
+    void worker();
+    void run_chunks();
+
+    std::vector<std::thread>    threads;
+
+    std::mutex                  jobmutex;   // one job at a time
+
+    std::mutex                  mutex;
+    std::condition_variable     wakeup;
+    std::condition_variable     finished;
+
+    const std::function<void(int, int)>* job=nullptr;
+    int                         jobsize=0;
+    int                         jobgrain=1;
+    std::atomic<int>            nextindex { 0 };
+    int                         active=0;
+    unsigned                    generation=0;
+    bool                        quit=false;
+};
+
+#endif
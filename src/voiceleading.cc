@@ -0,0 +1,986 @@
+#include <limits.h>
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <optional>
+#include "voiceleading.h"
+#include "voicingcache.h"
+#include "costkernel.h"
+#include "threadpool.h"
+#include "stats.h"
+
+// number of voicings of a bar handled by one worker at a time; a multiple of the SIMD width
+const static int transition_grain=64;
+
+// number of predecessors in the leaves of the k-d tree used by the exact Viterbi step
+const static int tree_leaf_size=32;
+
+// fewer reachable predecessors than this are simply scanned; measured on the strings ensemble,
+// whose larger tables start around this size
+const static int tree_min_predecessors=512;
+
+// number of committed bars whose scales are remembered in streaming mode
+const static int scale_memory=64;
+
+
+// pairs of voices moving in parallel octaves or fifths, which are forbidden
+static int count_parallel_motions(const Ensemble::VoicingView& v1, const Ensemble::VoicingView& v2)
+{
+    const int n=v1.get_voice_count();
+
+    int count=0;
+
+    for (int i=1;i<n;i++) {
+        for (int j=0;j<i;j++) {
+            int v=v1[i].get_midi_note() - v1[j].get_midi_note();
+            if (v%12!=0 && v%12!=7) continue;
+
+            if (v2[i].get_midi_note()==v2[j].get_midi_note()+v)
+                count++;
+        }
+    }
+
+    return count;
+}
+
+
+int compute_voice_leading_cost(const Ensemble::VoicingView& v1, const Ensemble::VoicingView& v2)
+{
+    const int n=v1.get_voice_count();
+
+    int cost=0;
+
+    for (int i=0;i<n;i++) {
+        int v=v1[i].get_midi_note() - v2[i].get_midi_note();
+        cost+=v*v;
+    }
+
+    return cost + 1000*count_parallel_motions(v1, v2);
+}
+
+
+// Only evaluated if statistics are enabled, as the solvers never look at single penalties.
+// voicing(i) gives the chosen voicing of bar i.
+template<typename GetVoicing>
+static void record_parallel_motions(int n, bool loop, GetVoicing voicing)
+{
+    if (!Stats::is_enabled()) return;
+
+    int count=0;
+    for (int i=1;i<n;i++)
+        count+=count_parallel_motions(voicing(i-1), voicing(i));
+
+    if (loop && n>1)
+        count+=count_parallel_motions(voicing(n-1), voicing(0));
+
+    Stats::add(Stats::Counter::ParallelMotions, count);
+}
+
+
+/*
+ * The reachable predecessors of a Viterbi step, organized as a k-d tree over their pitches.
+ * The sum of squares part of compute_voice_leading_cost is a lower bound of the whole cost,
+ * and for all predecessors within a subtree it is at least the squared distance to the pitch
+ * box spanned by the subtree.  Together with the cheapest path cost in the subtree, this bounds
+ * the cost of every path through the subtree from below, so a search for the best predecessor
+ * only has to descend into subtrees whose bound does not exceed the best cost found so far.
+ * The leaves are contiguous ranges of the pitch arrays and are scored with the cost kernel.
+ */
+class PredecessorTree {
+public:
+    PredecessorTree(const Ensemble::VoicingTable&, const std::vector<pathnode_t>&);
+
+    int size() const
+    {
+        return predecessors.size();
+    }
+
+    // Updates node to the best predecessor for the given voicing if that is cheaper.  Only
+    // strictly worse candidates are skipped and ties go to the lowest predecessor, so the
+    // result is exactly that of a full scan.  costs needs room for size() entries and pitches
+    // for one per voice.  Returns the number of predecessors scored.
+    int find_best(const Ensemble::VoicingView&, pathnode_t& node, int* costs, int* pitches) const;
+
+    int get_voice_count() const
+    {
+        return numvoices;
+    }
+
+private:
+    struct treenode_t {
+        int     begin;
+        int     end;
+        int     children;   // index of the first of two adjacent children, or -1 for leaves
+        int     mincost;
+    };
+
+    void build(const Ensemble::VoicingTable&, int m);
+
+    int lower_bound(int m, const int* pitches) const;
+
+    const int                       numvoices;
+
+    std::vector<int>                predecessors;
+    std::vector<int>                pathcosts;
+    std::vector<std::vector<uint8_t>> pitches;
+    std::vector<const uint8_t*>     pitcharrays;
+
+    std::vector<treenode_t>         nodes;
+    std::vector<uint8_t>            boxes;      // lowest and highest pitch of each voice per node
+};
+
+
+PredecessorTree::PredecessorTree(const Ensemble::VoicingTable& prev, const std::vector<pathnode_t>& prevnodes):numvoices(prev.get_voice_count())
+{
+    for (int k=0;k<prev.size();k++)
+        if (prevnodes[k].cost!=INT_MAX)
+            predecessors.push_back(k);
+
+    const int n=predecessors.size();
+    if (!n) return;
+
+    nodes.push_back(treenode_t { 0, n, -1, 0 });
+    build(prev, 0);
+
+    pathcosts.resize(n);
+    for (int t=0;t<n;t++)
+        pathcosts[t]=prevnodes[predecessors[t]].cost;
+
+    pitches.resize(numvoices);
+    for (int i=0;i<numvoices;i++) {
+        const uint8_t* prevpitches=prev.get_pitches(i);
+
+        pitches[i].resize(n);
+        for (int t=0;t<n;t++)
+            pitches[i][t]=prevpitches[predecessors[t]];
+
+        pitcharrays.push_back(pitches[i].data());
+    }
+
+    boxes.resize(nodes.size()*numvoices*2);
+
+    // children always come after their parent, so everything can be filled in bottom-up
+    for (int m=nodes.size()-1;m>=0;m--) {
+        treenode_t& node=nodes[m];
+        uint8_t* box=&boxes[m*numvoices*2];
+
+        if (node.children<0) {
+            node.mincost=INT_MAX;
+            for (int t=node.begin;t<node.end;t++)
+                node.mincost=std::min(node.mincost, pathcosts[t]);
+
+            for (int i=0;i<numvoices;i++) {
+                box[2*i  ]=*std::min_element(&pitches[i][node.begin], &pitches[i][node.end]);
+                box[2*i+1]=*std::max_element(&pitches[i][node.begin], &pitches[i][node.end]);
+            }
+        }
+        else {
+            const uint8_t* box0=&boxes[node.children*numvoices*2];
+            const uint8_t* box1=&boxes[(node.children+1)*numvoices*2];
+
+            node.mincost=std::min(nodes[node.children].mincost, nodes[node.children+1].mincost);
+
+            for (int i=0;i<numvoices;i++) {
+                box[2*i  ]=std::min(box0[2*i  ], box1[2*i  ]);
+                box[2*i+1]=std::max(box0[2*i+1], box1[2*i+1]);
+            }
+        }
+    }
+}
+
+
+// splits the predecessors of node m at the median pitch of the voice with the widest spread
+void PredecessorTree::build(const Ensemble::VoicingTable& prev, int m)
+{
+    const int begin=nodes[m].begin;
+    const int end=nodes[m].end;
+
+    if (end-begin<=tree_leaf_size)
+        return;
+
+    const uint8_t* splitpitches=nullptr;
+    int widest=-1;
+
+    for (int i=0;i<numvoices;i++) {
+        const uint8_t* p=prev.get_pitches(i);
+
+        int low=0xff, high=0;
+        for (int t=begin;t<end;t++) {
+            low =std::min<int>(low,  p[predecessors[t]]);
+            high=std::max<int>(high, p[predecessors[t]]);
+        }
+
+        if (high-low>widest) {
+            widest=high-low;
+            splitpitches=p;
+        }
+    }
+
+    const int mid=(begin+end)/2;
+    std::nth_element(predecessors.begin()+begin, predecessors.begin()+mid, predecessors.begin()+end, [splitpitches](int a, int b) {
+        return splitpitches[a]<splitpitches[b] || (splitpitches[a]==splitpitches[b] && a<b);
+    });
+
+    const int children=nodes.size();
+    nodes[m].children=children;
+    nodes.push_back(treenode_t { begin, mid, -1, 0 });
+    nodes.push_back(treenode_t { mid, end, -1, 0 });
+
+    build(prev, children);
+    build(prev, children+1);
+}
+
+
+int PredecessorTree::lower_bound(int m, const int* pitches) const
+{
+    const uint8_t* box=&boxes[m*numvoices*2];
+
+    int bound=nodes[m].mincost;
+
+    for (int i=0;i<numvoices;i++) {
+        const int d=std::max(box[2*i]-pitches[i], 0) + std::max(pitches[i]-box[2*i+1], 0);
+        bound+=d*d;
+    }
+
+    return bound;
+}
+
+
+int PredecessorTree::find_best(const Ensemble::VoicingView& voicing, pathnode_t& node, int* costs, int* pitches) const
+{
+    if (nodes.empty()) return 0;
+
+    for (int i=0;i<numvoices;i++)
+        pitches[i]=voicing[i].get_midi_note();
+
+    const VoicingCostKernel kernel(voicing, pitcharrays.data());
+
+    // depth first, nearer child first; the stack never holds more than one entry per level
+    struct { int node; int bound; } stack[64];
+    int top=0;
+
+    stack[top++]={ 0, lower_bound(0, pitches) };
+
+    int scored=0;
+
+    while (top>0) {
+        const auto entry=stack[--top];
+        if (entry.bound>node.cost) continue;
+
+        const treenode_t& treenode=nodes[entry.node];
+
+        if (treenode.children<0) {
+            kernel(treenode.begin, treenode.end, costs);
+            scored+=treenode.end-treenode.begin;
+
+            for (int t=treenode.begin;t<treenode.end;t++) {
+                const int cost=pathcosts[t] + costs[t];
+                const int k=predecessors[t];
+
+                if (cost<node.cost || (cost==node.cost && k<node.back)) {
+                    node.cost=cost;
+                    node.back=k;
+                }
+            }
+
+            continue;
+        }
+
+        const int bound0=lower_bound(treenode.children,   pitches);
+        const int bound1=lower_bound(treenode.children+1, pitches);
+
+        if (bound0<=bound1) {
+            stack[top++]={ treenode.children+1, bound1 };
+            stack[top++]={ treenode.children,   bound0 };
+        }
+        else {
+            stack[top++]={ treenode.children,   bound0 };
+            stack[top++]={ treenode.children+1, bound1 };
+        }
+    }
+
+    return scored;
+}
+
+
+// One Viterbi step; nodes with cost INT_MAX are unreachable and ties go to the lowest predecessor.
+// If remaining is given, nodes which cannot complete a path of cost <= bound become unreachable.
+static void advance(ThreadPool& pool, const Ensemble::VoicingTable& prev, const std::vector<pathnode_t>& prevnodes, const Ensemble::VoicingTable& cur, std::vector<pathnode_t>& curnodes, const std::vector<int>* remaining=nullptr, int bound=INT_MAX)
+{
+    curnodes.assign(cur.size(), pathnode_t { -1, INT_MAX });
+
+    int numreachable=0;
+    for (const pathnode_t& node: prevnodes)
+        if (node.cost!=INT_MAX)
+            numreachable++;
+
+    // Building the tree only pays off for many predecessors.  The per-start passes of loops
+    // keep too few of them reachable, so there the tree scores fewer transitions than the scan
+    // but still takes longer.
+    std::optional<PredecessorTree> tree;
+    if (!remaining && numreachable>=tree_min_predecessors)
+        tree.emplace(prev, prevnodes);
+
+    // every worker takes a range of current voicings
+    pool.parallel_for(cur.size(), transition_grain, [&](int begin, int end) {
+        std::vector<int> costs(tree ? tree->size() : cur.size());
+        int64_t transitions=0;
+
+        if (tree) {
+            std::vector<int> pitches(tree->get_voice_count());
+
+            for (int j=begin;j<end;j++)
+                transitions+=tree->find_best(cur[j], curnodes[j], costs.data(), pitches.data());
+        }
+        else {
+            transitions=int64_t(numreachable)*(end-begin);
+
+            for (int k=0;k<prev.size();k++) {
+                if (prevnodes[k].cost==INT_MAX) continue;
+
+                compute_voice_leading_costs(prev[k], cur, begin, end, costs.data());
+
+                for (int j=begin;j<end;j++) {
+                    int cost=prevnodes[k].cost + costs[j];
+
+                    if (cost<curnodes[j].cost) {
+                        curnodes[j].cost=cost;
+                        curnodes[j].back=k;
+                    }
+                }
+            }
+        }
+
+        if (remaining)
+            for (int j=begin;j<end;j++)
+                if (curnodes[j].cost!=INT_MAX && curnodes[j].cost>bound-(*remaining)[j])
+                    curnodes[j].cost=INT_MAX;
+
+        Stats::add(Stats::Counter::Transitions, transitions);
+    });
+}
+
+
+// cost of the cheapest path from each voicing of cur to the end, given the same for next
+static void retreat(ThreadPool& pool, const Ensemble::VoicingTable& cur, std::vector<int>& curremaining, const Ensemble::VoicingTable& next, const std::vector<int>& nextremaining)
+{
+    curremaining.resize(cur.size());
+
+    pool.parallel_for(cur.size(), transition_grain, [&](int begin, int end) {
+        std::vector<int> costs(next.size());
+
+        for (int j=begin;j<end;j++) {
+            compute_voice_leading_costs(cur[j], next, 0, next.size(), costs.data());
+
+            curremaining[j]=INT_MAX;
+            for (int k=0;k<next.size();k++)
+                curremaining[j]=std::min(curremaining[j], costs[k] + nextremaining[k]);
+        }
+
+        Stats::add(Stats::Counter::Transitions, int64_t(next.size())*(end-begin));
+    });
+}
+
+
+// best final node when the path has to return to the given voicing, or -1
+static int close_loop(const Ensemble::VoicingTable& last, const std::vector<pathnode_t>& nodes, const Ensemble::VoicingView& first, int& bestcost)
+{
+    int best=-1;
+    bestcost=INT_MAX;
+
+    int transitions=0;
+
+    for (int j=0;j<last.size();j++) {
+        if (nodes[j].cost==INT_MAX) continue;
+
+        int cost=nodes[j].cost + compute_voice_leading_cost(last[j], first);
+        transitions++;
+
+        if (cost<bestcost) {
+            bestcost=cost;
+            best=j;
+        }
+    }
+
+    Stats::add(Stats::Counter::Transitions, transitions);
+
+    return best;
+}
+
+
+static int compute_open_voice_leading(ThreadPool& pool, const std::vector<VoicingCache::TablePtr>& voicings, std::vector<Bar>& bars)
+{
+    const int n=bars.size();
+
+    std::vector<std::vector<pathnode_t>> pathnodes(n);
+    pathnodes[0].assign(voicings[0]->size(), pathnode_t { -1, 0 });
+
+    for (int i=1;i<n;i++)
+        advance(pool, *voicings[i-1], pathnodes[i-1], *voicings[i], pathnodes[i]);
+
+    int bestcost=INT_MAX;
+    int best=0;
+
+    int i=n-1;
+    for (int j=0;j<pathnodes[i].size();j++) {
+        if (pathnodes[i][j].cost<bestcost) {
+            bestcost=pathnodes[i][j].cost;
+            best=j;
+        }
+    }
+
+    int j=best;
+
+    while (i>=0) {
+        bars[i].voicing=Ensemble::Voicing((*voicings[i])[j]);
+        j=pathnodes[i--][j].back;
+    }
+
+    return bestcost;
+}
+
+
+/*
+ * Exact cyclic voice leading: the voicing of one anchor bar is fixed in turn to
+ * each of its candidates, the path is solved from there around the loop and back,
+ * and the cheapest of these cycles wins (ties going to the lowest candidate).
+ *
+ * The bar with the fewest voicings serves as anchor.  A pass without the loop
+ * closure in either direction yields lower bounds for every candidate and every
+ * node, so candidates are tried in order of their bound, candidates that cannot
+ * beat the best cycle found so far are skipped, and nodes that cannot be part of
+ * a better cycle are dropped.  The candidates are distributed over the thread pool.
+ */
+static int compute_cyclic_voice_leading(ThreadPool& pool, const std::vector<VoicingCache::TablePtr>& voicings, std::vector<Bar>& bars)
+{
+    const int n=bars.size();
+
+    int anchor=0;
+    for (int i=1;i<n;i++)
+        if (voicings[i]->size()<voicings[anchor]->size())
+            anchor=i;
+
+    std::vector<const Ensemble::VoicingTable*> order;
+    for (int i=0;i<n;i++)
+        order.push_back(voicings[(anchor+i)%n].get());
+
+    const Ensemble::VoicingTable& first=*order[0];
+    const int numstarts=first.size();
+
+    std::vector<std::vector<int>> remaining(n);
+    remaining[n-1].assign(order[n-1]->size(), 0);
+
+    for (int i=n-2;i>=0;i--)
+        retreat(pool, *order[i], remaining[i], *order[i+1], remaining[i+1]);
+
+    std::vector<std::vector<pathnode_t>> pathnodes(n);
+    pathnodes[0].assign(numstarts, pathnode_t { -1, 0 });
+
+    for (int i=1;i<n;i++)
+        advance(pool, *order[i-1], pathnodes[i-1], *order[i], pathnodes[i]);
+
+    std::vector<int> lowerbound(numstarts);
+    std::vector<int> starts(numstarts);
+
+    for (int s=0;s<numstarts;s++) {
+        int closing;
+        close_loop(*order[n-1], pathnodes[n-1], first[s], closing);
+
+        lowerbound[s]=std::max(remaining[0][s], closing);
+        starts[s]=s;
+    }
+
+    std::sort(starts.begin(), starts.end(), [&lowerbound](int a, int b) {
+        return lowerbound[a]<lowerbound[b] || (lowerbound[a]==lowerbound[b] && a<b);
+    });
+
+    std::vector<int> cyclecost(numstarts, INT_MAX);
+    std::atomic<int> bestcost(INT_MAX);
+
+    pool.parallel_for(numstarts, 1, [&](int begin, int end) {
+        std::vector<pathnode_t> prevnodes, curnodes;
+
+        for (int t=begin;t<end;t++) {
+            const int s=starts[t];
+            const int bound=bestcost;
+
+            if (lowerbound[s]>bound) continue;
+
+            prevnodes.assign(numstarts, pathnode_t { -1, INT_MAX });
+            prevnodes[s].cost=0;
+
+            // runs serially within this worker
+            for (int i=1;i<n;i++) {
+                advance(pool, *order[i-1], prevnodes, *order[i], curnodes, &remaining[i], bound);
+                std::swap(prevnodes, curnodes);
+            }
+
+            close_loop(*order[n-1], prevnodes, first[s], cyclecost[s]);
+
+            for (int best=bestcost; cyclecost[s]<best && !bestcost.compare_exchange_weak(best, cyclecost[s]););
+        }
+    });
+
+    int beststart=0;
+    for (int s=1;s<numstarts;s++)
+        if (cyclecost[s]<cyclecost[beststart])
+            beststart=s;
+
+    // repeat the pass for the winning start, this time keeping the back pointers
+    pathnodes[0].assign(numstarts, pathnode_t { -1, INT_MAX });
+    pathnodes[0][beststart].cost=0;
+
+    for (int i=1;i<n;i++)
+        advance(pool, *order[i-1], pathnodes[i-1], *order[i], pathnodes[i], &remaining[i], cyclecost[beststart]);
+
+    int closing;
+    int j=close_loop(*order[n-1], pathnodes[n-1], first[beststart], closing);
+
+    for (int i=n-1;i>=0;i--) {
+        bars[(anchor+i)%n].voicing=Ensemble::Voicing((*order[i])[j]);
+        j=pathnodes[i][j].back;
+    }
+
+    return closing;
+}
+
+
+int compute_voice_leading(VoicingCache& voicingcache, ThreadPool& pool, std::vector<Bar>& bars, bool loop)
+{
+    std::vector<VoicingCache::TablePtr> voicings;
+
+    for (const Bar& bar: bars)
+        voicings.push_back(voicingcache(bar.chord));
+
+    Stats::ScopedTimer timer(Stats::Timer::VoiceLeading);
+
+    const int cost=loop && bars.size()>1 ? compute_cyclic_voice_leading(pool, voicings, bars) : compute_open_voice_leading(pool, voicings, bars);
+    record_parallel_motions(bars.size(), loop, [&bars](int i) -> const Ensemble::Voicing& { return bars[i].voicing; });
+
+    return cost;
+}
+
+
+/*
+ * Beam search: only the width cheapest partial paths survive each bar.  Each
+ * voicing of a bar may end at most count of them, so the beam is not wasted on
+ * paths that differ only in their past, while count alternatives per voicing
+ * remain for returning the count best complete voice leadings.  In loops, the
+ * past still matters for closing the loop, so there the limit applies to each
+ * voicing and voicing of the first bar, and a wide enough beam is exact.
+ */
+std::vector<VoiceLeading> compute_voice_leading_beam(VoicingCache& voicingcache, ThreadPool& pool, const std::vector<Bar>& bars, bool loop, int width, int count)
+{
+    struct beamnode_t {
+        int     cost;
+        int     node;
+        int     parent;
+        int     start;
+    };
+
+    const int n=bars.size();
+
+    std::vector<VoicingCache::TablePtr> voicings;
+    for (const Bar& bar: bars)
+        voicings.push_back(voicingcache(bar.chord));
+
+    Stats::ScopedTimer timer(Stats::Timer::VoiceLeading);
+
+    std::vector<std::vector<beamnode_t>> beams(n);
+
+    // no pruning in the first bar, all of its voicings are equally good so far
+    for (int j=0;j<voicings[0]->size();j++)
+        beams[0].push_back(beamnode_t { 0, j, -1, j });
+
+    for (int i=1;i<n;i++) {
+        const Ensemble::VoicingTable& prev=*voicings[i-1];
+        const Ensemble::VoicingTable& cur=*voicings[i];
+        const std::vector<beamnode_t>& prevbeam=beams[i-1];
+        const bool closing=loop && i+1==n;
+
+        // Up to count best extensions ending in each voicing, cheapest first.  In loops, paths
+        // from different voicings of the first bar close the loop differently, so they are
+        // only recombined with paths from the same start.
+        std::vector<int> order(prevbeam.size());
+        std::iota(order.begin(), order.end(), 0);
+        if (loop)
+            std::stable_sort(order.begin(), order.end(), [&prevbeam](int a, int b) { return prevbeam[a].start<prevbeam[b].start; });
+
+        std::vector<std::vector<beamnode_t>> chunks((cur.size()+transition_grain-1)/transition_grain);
+
+        pool.parallel_for(cur.size(), transition_grain, [&](int begin, int end) {
+            std::vector<int> costs(cur.size());
+            std::vector<beamnode_t> slots((end-begin)*count);
+            std::vector<beamnode_t>& chunk=chunks[begin/transition_grain];
+
+            Stats::add(Stats::Counter::Transitions, int64_t(prevbeam.size())*(end-begin));
+
+            for (int g=0, h;g<order.size();g=h) {
+                for (h=g+1;h<order.size() && (!loop || prevbeam[order[h]].start==prevbeam[order[g]].start);h++);
+
+                slots.assign(slots.size(), beamnode_t { INT_MAX, -1, -1, -1 });
+
+                for (int o=g;o<h;o++) {
+                    const int e=order[o];
+                    compute_voice_leading_costs(prev[prevbeam[e].node], cur, begin, end, costs.data());
+
+                    for (int j=begin;j<end;j++) {
+                        int cost=prevbeam[e].cost + costs[j];
+                        if (closing)
+                            cost+=compute_voice_leading_cost(cur[j], (*voicings[0])[prevbeam[e].start]);
+
+                        beamnode_t* slot=&slots[(j-begin)*count];
+                        if (cost>=slot[count-1].cost) continue;
+
+                        int r=count-1;
+                        for (;r>0 && cost<slot[r-1].cost;r--)
+                            slot[r]=slot[r-1];
+
+                        slot[r]=beamnode_t { cost, j, e, prevbeam[e].start };
+                    }
+                }
+
+                for (const beamnode_t& c: slots)
+                    if (c.node>=0)
+                        chunk.push_back(c);
+            }
+        });
+
+        std::vector<beamnode_t> candidates;
+        for (const auto& chunk: chunks)
+            candidates.insert(candidates.end(), chunk.begin(), chunk.end());
+
+        // the candidates of each voicing are in the same order however the voicings were split
+        // into chunks, so sorting stably by cost and voicing keeps ties deterministic
+        std::stable_sort(candidates.begin(), candidates.end(), [](const beamnode_t& a, const beamnode_t& b) {
+            return a.cost<b.cost || (a.cost==b.cost && a.node<b.node);
+        });
+
+        if (candidates.size()>width)
+            candidates.resize(width);
+
+        beams[i]=std::move(candidates);
+    }
+
+    std::vector<VoiceLeading> result;
+
+    if (n==1)
+        beams[0].resize(std::min<int>(beams[0].size(), count));
+
+    for (int r=0;r<count && r<beams[n-1].size();r++) {
+        VoiceLeading leading;
+        leading.cost=beams[n-1][r].cost;
+        leading.voicings.resize(n);
+
+        for (int i=n-1, e=r;i>=0;e=beams[i--][e].parent)
+            leading.voicings[i]=Ensemble::Voicing((*voicings[i])[beams[i][e].node]);
+
+        result.push_back(std::move(leading));
+    }
+
+    if (!result.empty())
+        record_parallel_motions(n, loop, [&result](int i) -> const Ensemble::Voicing& { return result[0].voicings[i]; });
+
+    return result;
+}
+
+
+void compute_scales_for_chords(std::vector<Bar>& bars)
+{
+    Stats::ScopedTimer timer(Stats::Timer::Scales);
+
+    const int n=bars.size();
+
+    struct node_t {
+        Scale   scale;
+        int     nonchordtones;
+        int     cost;
+        int     back;
+    };
+
+    node_t* nodes=new node_t[n*7];
+    for (int i=0;i<n;i++) {
+        const Chord& chord=bars[i].chord;
+
+        for (int j=0;j<7;j++) {
+            nodes[i*7+j].scale=Scale(chord.notes[0], Scale::Mode(j));
+            nodes[i*7+j].nonchordtones=0;
+
+            for (int k=0;k<6 && chord.notes[k];k++)
+                if (!nodes[i*7+j].scale.contains(chord.notes[k]))
+                    nodes[i*7+j].nonchordtones++;
+        }
+    }
+
+    Scale alleged_tonic_scale(bars[0].chord.notes[0], bars[0].chord.quality==Chord::Quality::Minor ? Scale::Mode::Aeolian : Scale::Mode::Ionian);
+
+    for (int j=0;j<7;j++) {
+        nodes[j].cost=nodes[j].nonchordtones*16 + Scale::distance(alleged_tonic_scale, nodes[j].scale);
+        nodes[j].back=-1;
+    }
+
+    for (int i=1;i<n;i++) {
+        for (int j=0;j<7;j++) {
+            nodes[i*7+j].cost=INT_MAX;
+            nodes[i*7+j].back=0;
+
+            for (int k=0;k<7;k++) {
+                int cost=nodes[(i-1)*7+k].cost + nodes[i*7+j].nonchordtones*16;
+                int dist=Scale::distance(nodes[(i-1)*7+k].scale, nodes[i*7+j].scale);
+                if (dist)
+                    cost+=dist+1;
+
+                // check if we already had the same chord earlier in the progression -- if so, try to use the same scale
+                for (int p=i-1, q=k; p>=0; q=nodes[p--*7+q].back) {
+                    if (bars[i].chord==bars[p].chord) {
+                        if (nodes[i*7+j].scale!=nodes[p*7+q].scale)
+                            cost+=3;
+                        
+                        break;
+                    }
+                }
+                
+                if (cost<nodes[i*7+j].cost) {
+                    nodes[i*7+j].cost=cost;
+                    nodes[i*7+j].back=k;
+                }
+            }
+        }
+    }
+
+
+    int bestscale=0;
+    for (int j=0;j<7;j++)
+        if (nodes[(n-1)*7+j].cost < nodes[(n-1)*7+bestscale].cost)
+            bestscale=j;
+    
+    for (int i=n-1;i>=0;bestscale=nodes[i--*7+bestscale].back)
+        bars[i].scale=nodes[i*7+bestscale].scale;
+}
+
+
+ProgressionSolver::ProgressionSolver(VoicingCache& voicingcache, ThreadPool& pool, const std::vector<Chord>& chords, bool loop):voicingcache(voicingcache), pool(pool), loop(loop)
+{
+    for (const Chord& chord: chords) {
+        Bar bar;
+        bar.chord=chord;
+
+        bars.push_back(std::move(bar));
+        voicings.push_back(voicingcache(chord));
+    }
+
+    forward.resize(bars.size());
+    backward.resize(bars.size());
+
+    forwardvalid=0;
+    backwardvalid=bars.size();
+}
+
+
+void ProgressionSolver::replace_chord(int i, const Chord& chord)
+{
+    bars[i].chord=chord;
+    voicings[i]=voicingcache(chord);
+
+    forwardvalid=std::min(forwardvalid, i);
+    backwardvalid=std::max(backwardvalid, i+1);
+
+    lastedit=i;
+}
+
+
+int ProgressionSolver::solve()
+{
+    const int n=bars.size();
+    if (!n) return 0;
+
+    if (loop && n>1) {
+        const int cost=compute_voice_leading(voicingcache, pool, bars, true);
+        compute_scales_for_chords(bars);
+        return cost;
+    }
+
+    Stats::ScopedTimer timer(Stats::Timer::VoiceLeading);
+
+    // Every pivot between the valid ranges takes the same number of steps, and both ranges
+    // end at the pivot afterwards.  Putting it on the last edit keeps the next edit of the
+    // same bar down to two steps.
+    const int pivot=std::clamp(lastedit, std::max(forwardvalid-1, 0), std::min(backwardvalid, n-1));
+
+    for (;forwardvalid<=pivot;forwardvalid++) {
+        const int i=forwardvalid;
+
+        if (i==0)
+            forward[i].assign(voicings[i]->size(), pathnode_t { -1, 0 });
+        else
+            advance(pool, *voicings[i-1], forward[i-1], *voicings[i], forward[i]);
+    }
+
+    // the cost is symmetric, so the backward tables are built by the same step
+    for (;backwardvalid>pivot;backwardvalid--) {
+        const int i=backwardvalid-1;
+
+        if (i==n-1)
+            backward[i].assign(voicings[i]->size(), pathnode_t { -1, 0 });
+        else
+            advance(pool, *voicings[i+1], backward[i+1], *voicings[i], backward[i]);
+    }
+
+    int bestcost=INT_MAX;
+    int best=0;
+
+    for (int j=0;j<voicings[pivot]->size();j++) {
+        const int cost=forward[pivot][j].cost + backward[pivot][j].cost;
+        if (cost<bestcost) {
+            bestcost=cost;
+            best=j;
+        }
+    }
+
+    for (int i=pivot, j=best; i>=0; j=forward[i--][j].back)
+        bars[i].voicing=Ensemble::Voicing((*voicings[i])[j]);
+
+    for (int i=pivot, j=best; i<n; j=backward[i++][j].back)
+        bars[i].voicing=Ensemble::Voicing((*voicings[i])[j]);
+
+    record_parallel_motions(n, false, [this](int i) -> const Ensemble::Voicing& { return bars[i].voicing; });
+
+    compute_scales_for_chords(bars);
+
+    return bestcost;
+}
+
+
+StreamingVoiceLeading::StreamingVoiceLeading(VoicingCache& voicingcache, ThreadPool& pool, int lookahead):voicingcache(voicingcache), pool(pool), lookahead(std::max(lookahead, 0))
+{
+}
+
+
+std::vector<Bar> StreamingVoiceLeading::push(const Chord& chord)
+{
+    pending.push_back(chord);
+    voicings.push_back(voicingcache(chord));
+
+    std::vector<Bar> bars;
+
+    if (pending.size()>lookahead)
+        commit(1, bars);
+
+    return bars;
+}
+
+
+std::vector<Bar> StreamingVoiceLeading::finish()
+{
+    std::vector<Bar> bars;
+
+    if (!pending.empty())
+        commit(pending.size(), bars);
+
+    return bars;
+}
+
+
+// solves the pending bars from the last committed voicing and commits the first count of them
+void StreamingVoiceLeading::commit(int count, std::vector<Bar>& bars)
+{
+    const int n=pending.size();
+
+    std::vector<int> path(n);
+
+    {
+        Stats::ScopedTimer timer(Stats::Timer::VoiceLeading);
+
+        std::vector<std::vector<pathnode_t>> pathnodes(n);
+
+        if (havecommitted) {
+            std::vector<int> costs(voicings[0]->size());
+            compute_voice_leading_costs(lastvoicing, *voicings[0], 0, costs.size(), costs.data());
+            Stats::add(Stats::Counter::Transitions, costs.size());
+
+            for (int cost: costs)
+                pathnodes[0].push_back(pathnode_t { -1, cost });
+        }
+        else
+            pathnodes[0].assign(voicings[0]->size(), pathnode_t { -1, 0 });
+
+        for (int i=1;i<n;i++)
+            advance(pool, *voicings[i-1], pathnodes[i-1], *voicings[i], pathnodes[i]);
+
+        int best=0;
+        for (int j=1;j<pathnodes[n-1].size();j++)
+            if (pathnodes[n-1][j].cost<pathnodes[n-1][best].cost)
+                best=j;
+
+        for (int i=n-1, j=best; i>=0; j=pathnodes[i--][j].back)
+            path[i]=j;
+    }
+
+    for (int i=0;i<count;i++) {
+        Bar bar;
+        bar.chord=pending.front();
+        bar.scale=choose_scale(bar.chord);
+        bar.voicing=Ensemble::Voicing((*voicings.front())[path[i]]);
+
+        if (havecommitted)
+            record_parallel_motions(2, false, [&](int k) -> const Ensemble::Voicing& { return k ? bar.voicing : lastvoicing; });
+
+        lastvoicing=Ensemble::Voicing((*voicings.front())[path[i]]);
+        havecommitted=true;
+
+        bars.push_back(std::move(bar));
+
+        pending.pop_front();
+        voicings.pop_front();
+    }
+}
+
+
+Scale StreamingVoiceLeading::choose_scale(const Chord& chord)
+{
+    if (recentscales.empty())
+        tonic=Scale(chord.notes[0], chord.quality==Chord::Quality::Minor ? Scale::Mode::Aeolian : Scale::Mode::Ionian);
+
+    // try to use the same scale as the last time this chord came up
+    const Scale* previous=nullptr;
+    for (auto it=recentscales.rbegin(); it!=recentscales.rend(); ++it) {
+        if (it->first==chord) {
+            previous=&it->second;
+            break;
+        }
+    }
+
+    Scale best;
+    int bestcost=INT_MAX;
+
+    for (int j=0;j<7;j++) {
+        const Scale scale(chord.notes[0], Scale::Mode(j));
+
+        int cost=0;
+        for (int k=0;k<6 && chord.notes[k];k++)
+            if (!scale.contains(chord.notes[k]))
+                cost+=16;
+
+        if (recentscales.empty())
+            cost+=Scale::distance(tonic, scale);
+        else {
+            const int dist=Scale::distance(recentscales.back().second, scale);
+            if (dist)
+                cost+=dist+1;
+        }
+
+        if (previous && scale!=*previous)
+            cost+=3;
+
+        if (cost<bestcost) {
+            bestcost=cost;
+            best=scale;
+        }
+    }
+
+    recentscales.emplace_back(chord, best);
+    if (recentscales.size()>scale_memory)
+        recentscales.pop_front();
+
+    return best;
+}
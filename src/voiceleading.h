@@ -0,0 +1,140 @@
+#ifndef INCLUDE_VOICELEADING_H
+#define INCLUDE_VOICELEADING_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include "chord.h"
+#include "scale.h"
+#include "ensemble.h"
+
+class VoicingCache;
+class ThreadPool;
+
+
+struct Bar {
+    Chord               chord;
+    Scale               scale;
+    Ensemble::Voicing   voicing;
+};
+
+
+// node of the voice leading dynamic program: cost of the cheapest path to a voicing and its predecessor
+struct pathnode_t {
+    int                 back;
+    int                 cost;
+};
+
+
+struct VoiceLeading {
+    int                             cost;
+    std::vector<Ensemble::Voicing>  voicings;
+};
+
+
+int compute_voice_leading_cost(const Ensemble::VoicingView&, const Ensemble::VoicingView&);
+
+// Choose one voicing per bar such that the total voice leading cost is minimal, and return that cost.
+// If loop is set, the transition from the last bar back to the first one is included.
+// The result does not depend on the number of threads in the pool.
+int compute_voice_leading(VoicingCache&, ThreadPool&, std::vector<Bar>&, bool loop);
+
+// Approximate the above by a beam search keeping only the width cheapest partial paths
+// per bar, and return the count cheapest voice leadings found (cheapest first).
+std::vector<VoiceLeading> compute_voice_leading_beam(VoicingCache&, ThreadPool&, const std::vector<Bar>&, bool loop, int width, int count);
+
+// Choose a scale for every bar from the chords.
+void compute_scales_for_chords(std::vector<Bar>&);
+
+
+/*
+ * Keeps the voice leading of a progression up to date while single chords get replaced,
+ * as needed by interactive editing.  The forward and backward tables of the dynamic program
+ * are kept, and any bar where both are valid yields the optimum.  Replacing a chord only
+ * invalidates the forward tables from that bar on and the backward tables up to it, and
+ * solve() only recomputes the tables between the valid ranges.  So editing the same bar
+ * over and over costs two bars of work, and editing another bar costs about the distance
+ * to the previous edit.
+ *
+ * The total cost always equals that of compute_voice_leading, but among equally cheap voice
+ * leadings a different one may be picked.  Loops are solved from scratch on every change.
+ * The scales are recomputed as a whole, which is cheap.
+ */
+class ProgressionSolver {
+public:
+    ProgressionSolver(VoicingCache&, ThreadPool&, const std::vector<Chord>&, bool loop=false);
+
+    int size() const
+    {
+        return bars.size();
+    }
+
+    void replace_chord(int i, const Chord&);
+
+    // brings voicings and scales of all bars up to date and returns the total cost
+    int solve();
+
+    const std::vector<Bar>& get_bars() const
+    {
+        return bars;
+    }
+
+private:
+    VoicingCache&   voicingcache;
+    ThreadPool&     pool;
+    const bool      loop;
+
+    std::vector<Bar>    bars;
+    std::vector<std::shared_ptr<const Ensemble::VoicingTable>>  voicings;
+
+    // forward[i] is valid for i<forwardvalid and backward[i] for i>=backwardvalid;
+    // the back pointers of the backward tables point to the following bar
+    std::vector<std::vector<pathnode_t>>    forward;
+    std::vector<std::vector<pathnode_t>>    backward;
+    int                                     forwardvalid;
+    int                                     backwardvalid;
+
+    // the pivot of the next solve, where both valid ranges end afterwards
+    int                                     lastedit=0;
+};
+
+
+/*
+ * Online voice leading for unbounded chord input by fixed-lag Viterbi.  A bar is committed
+ * once lookahead further chords are known, with the voicing the best path through all pending
+ * bars (starting from the last committed voicing) gives it, and never changes afterwards.
+ * Only the pending bars are kept, so memory does not grow with the length of the input.
+ * If the whole input fits into the lookahead, the result equals compute_voice_leading.
+ *
+ * Scales are chosen greedily for each committed bar by the criteria of compute_scales_for_chords,
+ * remembering the scales of recent bars for repeated chords.
+ */
+class StreamingVoiceLeading {
+public:
+    StreamingVoiceLeading(VoicingCache&, ThreadPool&, int lookahead);
+
+    // appends a chord and returns the bars committed due to it
+    std::vector<Bar> push(const Chord&);
+
+    // commits all pending bars at the end of the input
+    std::vector<Bar> finish();
+
+private:
+    void commit(int count, std::vector<Bar>&);
+    Scale choose_scale(const Chord&);
+
+    VoicingCache&   voicingcache;
+    ThreadPool&     pool;
+    const int       lookahead;
+
+    std::deque<Chord>   pending;
+    std::deque<std::shared_ptr<const Ensemble::VoicingTable>>   voicings;
+
+    bool                havecommitted=false;
+    Ensemble::Voicing   lastvoicing;
+
+    Scale               tonic;
+    std::deque<std::pair<Chord, Scale>> recentscales;
+};
+
+#endif
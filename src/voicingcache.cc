@@ -0,0 +1,188 @@
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "voicingcache.h"
+#include "stats.h"
+
+const static char cache_magic[8]={ 'C', 'P', 'V', 'O', 'I', 'C', 'E', '1' };
+
+
+VoicingCache::Key::Key(const Chord& chord):required(chord.required), bass(chord.bass)
+{
+    for (int i=0;i<6;i++)
+        notes[i]=chord.notes[i];
+}
+
+
+bool VoicingCache::Key::operator==(const Key& rhs) const
+{
+    // the required tones are part of the key since e.g. C6 and C+13 have the same notes
+    if (required!=rhs.required || bass!=rhs.bass)
+        return false;
+
+    for (int i=0;i<6;i++)
+        if (notes[i]!=rhs.notes[i])
+            return false;
+
+    return true;
+}
+
+
+size_t VoicingCache::HashKey::operator()(const Key& key) const
+{
+    uint8_t bytes[sizeof(NoteClass)*7];
+    memcpy(bytes, &key.bass, sizeof(NoteClass));
+    memcpy(bytes+sizeof(NoteClass), key.notes, sizeof(NoteClass)*6);
+
+    uint64_t hash=14695981039346656037ull ^ key.required;
+    for (uint8_t b: bytes)
+        hash=(hash ^ b) * 1099511628211ull;
+
+    return hash;
+}
+
+
+VoicingCache::VoicingCache(const Ensemble& ensemble):ensemble(ensemble), fingerprint(ensemble.get_fingerprint())
+{
+}
+
+
+VoicingCache::TablePtr VoicingCache::operator()(const Chord& chord)
+{
+    const Key key(chord);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        auto it=tables.find(key);
+        if (it!=tables.end())
+            return it->second;
+    }
+
+    TablePtr table=std::make_shared<const Ensemble::VoicingTable>(ensemble.enumerate_harmony_voicings(chord));
+    Stats::add(Stats::Counter::VoicingTables, 1);
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto inserted=tables.emplace(key, table);
+    if (inserted.second)
+        modified=true;
+
+    return inserted.first->second;
+}
+
+
+// as enumerated, i.e. valid notes in strictly ascending order
+static bool is_valid_voicing(const std::vector<Note>& voicing)
+{
+    for (int i=0;i<voicing.size();i++) {
+        if (!voicing[i].is_valid())
+            return false;
+
+        if (i>0 && voicing[i]<=voicing[i-1])
+            return false;
+    }
+
+    return true;
+}
+
+
+bool VoicingCache::load(const std::string& filename)
+{
+    FILE* file=fopen(filename.c_str(), "rb");
+    if (!file)
+        return false;
+
+    char magic[sizeof(cache_magic)];
+    uint64_t filefingerprint;
+    int32_t numvoices;
+
+    bool ok=fread(magic, sizeof(magic), 1, file)==1 && !memcmp(magic, cache_magic, sizeof(magic)) &&
+            fread(&filefingerprint, sizeof(filefingerprint), 1, file)==1 && filefingerprint==fingerprint &&
+            fread(&numvoices, sizeof(numvoices), 1, file)==1 && numvoices==ensemble.get_harmony_voice_count();
+
+    std::unordered_map<Key, TablePtr, HashKey> loaded;
+
+    while (ok) {
+        Chord chord;
+        int32_t count;
+
+        if (fread(&chord.required, sizeof(chord.required), 1, file)!=1)
+            break;  // regular end of file
+
+        ok=fread(&chord.bass, sizeof(NoteClass), 1, file)==1 &&
+           fread(chord.notes, sizeof(NoteClass), 6, file)==6 &&
+           fread(&count, sizeof(count), 1, file)==1 && count>=0 &&
+           chord.bass.is_valid() && std::all_of(chord.notes, chord.notes+6, [](const NoteClass& n) { return n.is_valid(); });
+        if (!ok) break;
+
+        auto table=std::make_shared<Ensemble::VoicingTable>(numvoices);
+
+        // a damaged file could claim any count, so cap the reservation
+        table->reserve(std::min<int32_t>(count, 4096));
+
+        std::vector<Note> voicing(numvoices);
+        for (int i=0;ok && i<count;i++) {
+            ok=fread(voicing.data(), sizeof(Note), numvoices, file)==numvoices && is_valid_voicing(voicing);
+            if (ok)
+                table->append(voicing.data());
+        }
+
+        loaded.emplace(Key(chord), std::move(table));
+    }
+
+    fclose(file);
+
+    if (!ok)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto& entry: loaded)
+        tables.insert(std::move(entry));
+
+    return true;
+}
+
+
+bool VoicingCache::save(const std::string& filename) const
+{
+    const std::string tmpname=filename + ".tmp";
+
+    FILE* file=fopen(tmpname.c_str(), "wb");
+    if (!file)
+        return false;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    const int32_t numvoices=ensemble.get_harmony_voice_count();
+
+    bool ok=fwrite(cache_magic, sizeof(cache_magic), 1, file)==1 &&
+            fwrite(&fingerprint, sizeof(fingerprint), 1, file)==1 &&
+            fwrite(&numvoices, sizeof(numvoices), 1, file)==1;
+
+    for (const auto& entry: tables) {
+        const Key& key=entry.first;
+        const Ensemble::VoicingTable& table=*entry.second;
+        const int32_t count=table.size();
+
+        ok=ok && fwrite(&key.required, sizeof(key.required), 1, file)==1 &&
+                 fwrite(&key.bass, sizeof(NoteClass), 1, file)==1 &&
+                 fwrite(key.notes, sizeof(NoteClass), 6, file)==6 &&
+                 fwrite(&count, sizeof(count), 1, file)==1;
+
+        for (int i=0;ok && i<count;i++)
+            ok=fwrite(&table[i][0], sizeof(Note), numvoices, file)==numvoices;
+    }
+
+    if (fclose(file)!=0)
+        ok=false;
+
+    if (!ok || rename(tmpname.c_str(), filename.c_str())!=0) {
+        remove(tmpname.c_str());
+        return false;
+    }
+
+    return true;
+}
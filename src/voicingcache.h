@@ -0,0 +1,58 @@
+#ifndef INCLUDE_VOICINGCACHE_H
+#define INCLUDE_VOICINGCACHE_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "chord.h"
+#include "ensemble.h"
+
+
+// Hands out the harmony voicings of a chord, enumerating each distinct chord only once.
+// The tables are immutable once created and can be shared between bars and threads.
+class VoicingCache {
+public:
+    typedef std::shared_ptr<const Ensemble::VoicingTable> TablePtr;
+
+    explicit VoicingCache(const Ensemble&);
+
+    const Ensemble& get_ensemble() const
+    {
+        return ensemble;
+    }
+
+    TablePtr operator()(const Chord&);
+
+    bool load(const std::string& filename);
+    bool save(const std::string& filename) const;
+
+    bool is_modified() const
+    {
+        return modified;
+    }
+
+private:
+    struct Key {
+        uint8_t     required;
+        NoteClass   bass;
+        NoteClass   notes[6];
+
+        explicit Key(const Chord&);
+
+        bool operator==(const Key&) const;
+    };
+
+    struct HashKey {
+        size_t operator()(const Key&) const;
+    };
+
+    const Ensemble&     ensemble;
+    const uint64_t      fingerprint;
+
+    mutable std::mutex  mutex;
+    std::unordered_map<Key, TablePtr, HashKey> tables;
+    bool                modified=false;
+};
+
+#endif